@@ -26,7 +26,9 @@
 #include "libc/types.h"
 #include "libc/stdio.h"
 #include "libc/nostd.h"
+#include "libc/string.h"
 #include "automaton.h"
+#include "trace.h"
 
 
 static const char *dfuusb_states[] = {
@@ -35,10 +37,39 @@ static const char *dfuusb_states[] = {
     "DFUUSB_STATE_GETHEADER",
     "DFUUSB_STATE_AUTH",
     "DFUUSB_STATE_DWNLOAD",
-    "DFUUSB_STATE_ERROR"
+    "DFUUSB_STATE_ERROR",
+    "DFUUSB_STATE_RECOVER"
 };
 
-volatile t_dfuusb_state current_state = DFUUSB_STATE_IDLE;
+/*
+ * Allowed transitions, one bitmap of target states per source state.
+ * Going back to IDLE (new download, error) and to ERROR is always allowed.
+ */
+#define TO(state) (1 << (state))
+
+static const uint8_t dfuusb_transitions[DFUUSB_STATE_NUM] = {
+    [DFUUSB_STATE_INIT]      = TO(DFUUSB_STATE_IDLE) | TO(DFUUSB_STATE_ERROR),
+    [DFUUSB_STATE_IDLE]      = TO(DFUUSB_STATE_IDLE) | TO(DFUUSB_STATE_GETHEADER) |
+                               TO(DFUUSB_STATE_AUTH) | TO(DFUUSB_STATE_ERROR),
+    [DFUUSB_STATE_GETHEADER] = TO(DFUUSB_STATE_IDLE) | TO(DFUUSB_STATE_AUTH) |
+                               TO(DFUUSB_STATE_ERROR),
+    [DFUUSB_STATE_AUTH]      = TO(DFUUSB_STATE_IDLE) | TO(DFUUSB_STATE_DWNLOAD) |
+                               TO(DFUUSB_STATE_ERROR),
+    [DFUUSB_STATE_DWNLOAD]   = TO(DFUUSB_STATE_IDLE) | TO(DFUUSB_STATE_RECOVER) |
+                               TO(DFUUSB_STATE_ERROR),
+    [DFUUSB_STATE_ERROR]     = TO(DFUUSB_STATE_IDLE) | TO(DFUUSB_STATE_ERROR),
+    /* waiting for the host to restart the failed crypto chunk */
+    [DFUUSB_STATE_RECOVER]   = TO(DFUUSB_STATE_IDLE) | TO(DFUUSB_STATE_DWNLOAD) |
+                               TO(DFUUSB_STATE_ERROR),
+};
+
+_Static_assert(DFUUSB_STATE_NUM <= 8, "transition bitmaps are 8 bits wide");
+
+volatile t_dfuusb_state current_state = DFUUSB_STATE_INIT;
+
+static t_dfuusb_state_stats state_stats[DFUUSB_STATE_NUM] = { 0 };
+static uint64_t state_entered = 0;
+static volatile uint32_t illegal_transitions = 0;
 
 t_dfuusb_state get_task_state(void)
 {
@@ -47,11 +78,46 @@ t_dfuusb_state get_task_state(void)
 
 const char *get_state_name(t_dfuusb_state state)
 {
+    if (state >= DFUUSB_STATE_NUM) {
+        return "DFUUSB_STATE_UNKNOWN";
+    }
     return dfuusb_states[state];
 }
 
-void set_task_state(t_dfuusb_state state)
+/* return -1 (keeping the current state) if the transition is not allowed */
+int set_task_state(t_dfuusb_state state)
 {
-    printf("state: %s => %s\n", get_state_name(current_state), get_state_name(state));
+    uint64_t now;
+
+    if (state >= DFUUSB_STATE_NUM ||
+        !(dfuusb_transitions[current_state] & TO(state))) {
+        illegal_transitions++;
+        TRACE_ERR(TRACE_EV_ILLEGAL_STATE, current_state, state);
+        return -1;
+    }
+    TRACE_INFO(TRACE_EV_STATE, current_state, state);
+    now = get_timestamp();
+    state_stats[current_state].time += now - state_entered;
+    state_stats[state].entries++;
+    state_entered = now;
     current_state = state;
+    return 0;
+}
+
+void get_state_stats(t_dfuusb_state state, t_dfuusb_state_stats *stats)
+{
+    if (state >= DFUUSB_STATE_NUM) {
+        memset(stats, 0, sizeof(t_dfuusb_state_stats));
+        return;
+    }
+    *stats = state_stats[state];
+    /* including the time spent in the current state up to now */
+    if (state == current_state) {
+        stats->time += get_timestamp() - state_entered;
+    }
+}
+
+uint32_t get_illegal_transitions(void)
+{
+    return illegal_transitions;
 }
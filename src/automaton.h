@@ -25,25 +25,39 @@
 #ifndef AUTOMATON_H_
 #define AUTOMATON_H_
 
+#include "libc/types.h"
+
 typedef enum {
     DFUUSB_STATE_INIT = 0,
     DFUUSB_STATE_IDLE,
     DFUUSB_STATE_GETHEADER,
     DFUUSB_STATE_AUTH,
     DFUUSB_STATE_DWNLOAD,
-    DFUUSB_STATE_ERROR
+    DFUUSB_STATE_ERROR,
+    DFUUSB_STATE_RECOVER,
+    DFUUSB_STATE_NUM
 } t_dfuusb_state;
 
+/* per state accounting, time unit depending on the timestamping permission */
+typedef struct __attribute__((packed)) {
+    uint32_t entries;
+    uint64_t time;
+} t_dfuusb_state_stats;
+
 t_dfuusb_state
 get_task_state(void);
 
 const char*
 get_state_name(t_dfuusb_state state);
 
-void
+int
 set_task_state(t_dfuusb_state state);
 
-const char *get_state_name(t_dfuusb_state state);
+void
+get_state_stats(t_dfuusb_state state, t_dfuusb_state_stats *stats);
+
+uint32_t
+get_illegal_transitions(void);
 
 
 #endif/*!AUTOMATON_H_*/
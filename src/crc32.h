@@ -0,0 +1,36 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_CRC32_H_
+#define DFUUSB_CRC32_H_
+
+#include "libc/types.h"
+
+/*
+ * CRC32 (IEEE 802.3, reflected, as zlib crc32()). Start with crc = 0, and
+ * give back the previous result to continue over several buffers.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif/*!DFUUSB_CRC32_H_*/
@@ -0,0 +1,99 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "crc32.h"
+#include "perf.h"
+#include "digest.h"
+#if CONFIG_APP_DFUUSB_DIGEST_SHA256
+# include "libsig.h"
+#endif
+
+#if CONFIG_APP_DFUUSB_DIGEST
+
+static volatile t_digest_state digest_state = DIGEST_STATE_NONE;
+static uint32_t digest_bytes = 0;
+static uint32_t digest_crc32 = 0;
+#if CONFIG_APP_DFUUSB_DIGEST_SHA256
+static sha256_context digest_sha256_ctx;
+static uint8_t digest_sha256[SHA256_DIGEST_SIZE];
+#endif
+
+void digest_reset(void)
+{
+    digest_bytes = 0;
+    digest_crc32 = 0;
+#if CONFIG_APP_DFUUSB_DIGEST_SHA256
+    sha256_init(&digest_sha256_ctx);
+    memset(digest_sha256, 0, sizeof(digest_sha256));
+#endif
+    digest_state = DIGEST_STATE_RUNNING;
+}
+
+void digest_update(const uint8_t *buf, uint16_t len)
+{
+    if (digest_state != DIGEST_STATE_RUNNING) {
+        return;
+    }
+    perf_digest_begin();
+    digest_crc32 = crc32_update(digest_crc32, buf, len);
+#if CONFIG_APP_DFUUSB_DIGEST_SHA256
+    sha256_update(&digest_sha256_ctx, buf, len);
+#endif
+    digest_bytes += len;
+    perf_digest_end();
+}
+
+void digest_final(void)
+{
+    if (digest_state != DIGEST_STATE_RUNNING) {
+        return;
+    }
+#if CONFIG_APP_DFUUSB_DIGEST_SHA256
+    sha256_final(&digest_sha256_ctx, digest_sha256);
+#endif
+    digest_state = DIGEST_STATE_FINAL;
+}
+
+void digest_invalidate(void)
+{
+    digest_state = DIGEST_STATE_INVALID;
+}
+
+void digest_get_info(t_dfu_digest_info *info)
+{
+    memset(info, 0, sizeof(t_dfu_digest_info));
+    info->state = digest_state;
+    info->bytes = digest_bytes;
+    info->crc32 = digest_crc32;
+#if CONFIG_APP_DFUUSB_DIGEST_SHA256
+    info->has_sha256 = 1;
+    if (digest_state == DIGEST_STATE_FINAL) {
+        memcpy(info->sha256, digest_sha256, sizeof(info->sha256));
+    }
+#endif
+}
+
+#endif
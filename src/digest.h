@@ -0,0 +1,71 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_DIGEST_H_
+#define DFUUSB_DIGEST_H_
+
+#include "libc/types.h"
+
+/*
+ * Streaming digest of the image bytes forwarded to dfucrypto, so that the
+ * host can check the download integrity without reading the image back.
+ */
+typedef enum {
+    DIGEST_STATE_NONE = 0,   /* no download yet */
+    DIGEST_STATE_RUNNING,    /* download in progress */
+    DIGEST_STATE_FINAL,      /* download finished, digest is valid */
+    DIGEST_STATE_INVALID     /* the stream has been broken (resume, error) */
+} t_digest_state;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  state;          /* t_digest_state */
+    uint8_t  has_sha256;
+    uint16_t reserved;
+    uint32_t bytes;
+    uint32_t crc32;
+    uint8_t  sha256[32];     /* only valid if has_sha256 */
+} t_dfu_digest_info;
+
+#if CONFIG_APP_DFUUSB_DIGEST
+
+void digest_reset(void);
+
+void digest_update(const uint8_t *buf, uint16_t len);
+
+void digest_final(void);
+
+void digest_invalidate(void);
+
+void digest_get_info(t_dfu_digest_info *info);
+
+#else
+
+# define digest_reset()           do {} while (0)
+# define digest_update(buf, len)  do {} while (0)
+# define digest_final()           do {} while (0)
+# define digest_invalidate()      do {} while (0)
+
+#endif
+
+#endif/*!DFUUSB_DIGEST_H_*/
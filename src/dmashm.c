@@ -0,0 +1,150 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "dmashm.h"
+#include "trace.h"
+
+/* NOTE: alignment due to DMA */
+static struct {
+    uint8_t slots[DMASHM_SLOTS][DMASHM_SLOT_SIZE];
+#if DMASHM_HEADER_SIZE
+    uint8_t header[DMASHM_HEADER_SIZE];
+#endif
+} __attribute__((aligned(4))) dmashm = { 0 };
+
+#if DMASHM_RING_SLOTS
+/*
+ * Ring of slots in flight to dfucrypto. dfucrypto handles store requests
+ * in order, so acknowledges always release the oldest slot (tail).
+ * Indexes are relative to slot 1, slot 0 being the libdfu buffer.
+ */
+static volatile uint8_t ring_head = 0;
+static volatile uint8_t ring_tail = 0;
+static volatile uint8_t ring_count = 0;
+#endif
+
+uint8_t *dmashm_get_buf(void)
+{
+    return &dmashm.slots[0][0];
+}
+
+uint8_t *dmashm_get_slot(uint8_t slot)
+{
+    if (slot >= DMASHM_SLOTS) {
+        return NULL;
+    }
+    return &dmashm.slots[slot][0];
+}
+
+#if CONFIG_APP_DFUUSB_HEADER_XFER_SHM
+uint8_t *dmashm_get_header(void)
+{
+    return &dmashm.header[0];
+}
+#endif
+
+#if DMASHM_RING_SLOTS
+bool dmashm_ring_full(void)
+{
+    return ring_count >= DMASHM_RING_SLOTS;
+}
+
+uint8_t dmashm_ring_count(void)
+{
+    return ring_count;
+}
+
+/* acquire the ring head slot. The slot stays busy up to its acknowledge */
+int dmashm_ring_push(uint8_t *slot)
+{
+    if (slot == NULL || dmashm_ring_full()) {
+        goto err;
+    }
+    *slot = 1 + ring_head;
+    if (++ring_head >= DMASHM_RING_SLOTS) {
+        ring_head = 0;
+    }
+    ring_count++;
+    return 0;
+err:
+    return -1;
+}
+
+/* release the ring tail slot, which must be the acknowledged one */
+int dmashm_ring_pop(uint8_t slot)
+{
+    if (ring_count == 0) {
+        goto err;
+    }
+    if (slot != 1 + ring_tail) {
+        TRACE_ERR(TRACE_EV_SLOT_ERR, slot, 1 + ring_tail);
+        goto err;
+    }
+    if (++ring_tail >= DMASHM_RING_SLOTS) {
+        ring_tail = 0;
+    }
+    ring_count--;
+    return 0;
+err:
+    return -1;
+}
+
+/* release the ring head slot, which has not been handed to dfucrypto */
+int dmashm_ring_cancel(uint8_t slot)
+{
+    uint8_t head = (ring_head == 0) ? DMASHM_RING_SLOTS - 1 : ring_head - 1;
+
+    if (ring_count == 0) {
+        goto err;
+    }
+    if (slot != 1 + head) {
+        TRACE_ERR(TRACE_EV_SLOT_ERR, slot, 1 + head);
+        goto err;
+    }
+    ring_head = head;
+    ring_count--;
+    return 0;
+err:
+    return -1;
+}
+
+/* release the slots from the given one up to the ring head, none of them
+ * having been handed to dfucrypto (requests are sent in slot order) */
+int dmashm_ring_cancel_from(uint8_t slot)
+{
+    uint8_t head;
+
+    do {
+        if (ring_count == 0) {
+            goto err;
+        }
+        head = (ring_head == 0) ? DMASHM_RING_SLOTS - 1 : ring_head - 1;
+        dmashm_ring_cancel(1 + head);
+    } while (1 + head != slot);
+    return 0;
+err:
+    return -1;
+}
+#endif
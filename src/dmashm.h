@@ -0,0 +1,86 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_DMASHM_H_
+#define DFUUSB_DMASHM_H_
+
+#include "libc/types.h"
+
+/*
+ * DMA shared memory layout (shared with dfucrypto):
+ *
+ * +--------+--------+--------+-----+----------+
+ * | slot 0 | slot 1 | slot 2 | ... | slot N-1 |
+ * +--------+--------+--------+-----+----------+
+ *
+ * Slot 0 is the libdfu transfer buffer, in which the USB stack receives
+ * DNLOAD blocks and into which dfucrypto writes UPLOAD data.
+ * When more than one slot is configured, slots 1 to N-1 form a FIFO ring:
+ * each received block is copied into the ring head and handed to
+ * dfucrypto by its slot index, so that the host can send the next block
+ * while dfucrypto is still decrypting and flashing the previous ones.
+ * With a single slot, the block is handed to dfucrypto in place and
+ * USB reception is serialized with the store acknowledge.
+ * When the header is handed to dfucrypto through the DMA SHM, a dedicated
+ * header region follows the slots.
+ */
+#define DMASHM_SLOT_SIZE  CONFIG_APP_DFUUSB_SHM_SLOT_SIZE
+#define DMASHM_SLOTS      CONFIG_APP_DFUUSB_SHM_SLOTS
+#define DMASHM_RING_SLOTS (DMASHM_SLOTS - 1)
+#if CONFIG_APP_DFUUSB_HEADER_XFER_SHM
+# define DMASHM_HEADER_SIZE CONFIG_APP_DFUUSB_HEADER_LEN
+#else
+# define DMASHM_HEADER_SIZE 0
+#endif
+#define DMASHM_SIZE       ((DMASHM_SLOTS * DMASHM_SLOT_SIZE) + DMASHM_HEADER_SIZE)
+
+/* the SHM size is exchanged on 16 bits with dfucrypto */
+_Static_assert(DMASHM_SIZE <= 0xffff, "DMA SHM size must fit in 16 bits");
+_Static_assert((DMASHM_SLOT_SIZE % 4) == 0, "DMA SHM slots must be word aligned");
+/* dfucrypto deduces the number of slots from the SHM and slot sizes */
+_Static_assert(DMASHM_HEADER_SIZE < DMASHM_SLOT_SIZE, "DMA SHM header region must be smaller than a slot");
+
+uint8_t *dmashm_get_buf(void);
+
+uint8_t *dmashm_get_slot(uint8_t slot);
+
+#if CONFIG_APP_DFUUSB_HEADER_XFER_SHM
+uint8_t *dmashm_get_header(void);
+#endif
+
+#if DMASHM_RING_SLOTS
+bool dmashm_ring_full(void);
+
+uint8_t dmashm_ring_count(void);
+
+int dmashm_ring_push(uint8_t *slot);
+
+int dmashm_ring_pop(uint8_t slot);
+
+int dmashm_ring_cancel(uint8_t slot);
+
+int dmashm_ring_cancel_from(uint8_t slot);
+#endif
+
+#endif/*!DFUUSB_DMASHM_H_*/
@@ -0,0 +1,78 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "event.h"
+
+#define EVENT_RING_SIZE 16
+_Static_assert((EVENT_RING_SIZE & (EVENT_RING_SIZE - 1)) == 0, "event ring size must be a power of two");
+
+/*
+ * head is only written by the producer and tail by the consumer. The
+ * indexes are free running, their difference being the ring usage.
+ */
+static t_dfuusb_event event_ring[EVENT_RING_SIZE];
+static uint8_t event_head = 0;
+static uint8_t event_tail = 0;
+static volatile uint32_t event_drops = 0;
+
+int dfuusb_event_push(t_dfuusb_event_type type, uint32_t arg)
+{
+    uint8_t head = __atomic_load_n(&event_head, __ATOMIC_RELAXED);
+    uint8_t tail = __atomic_load_n(&event_tail, __ATOMIC_ACQUIRE);
+
+    if ((uint8_t)(head - tail) >= EVENT_RING_SIZE) {
+        /* no trace from ISR context, reported by the main thread */
+        event_drops++;
+        goto err;
+    }
+    event_ring[head & (EVENT_RING_SIZE - 1)].type = type;
+    event_ring[head & (EVENT_RING_SIZE - 1)].arg = arg;
+    /* the event is written before being published */
+    __atomic_store_n(&event_head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+    return 0;
+err:
+    return -1;
+}
+
+int dfuusb_event_pop(t_dfuusb_event *ev)
+{
+    uint8_t tail = __atomic_load_n(&event_tail, __ATOMIC_RELAXED);
+    uint8_t head = __atomic_load_n(&event_head, __ATOMIC_ACQUIRE);
+
+    if (tail == head) {
+        goto err;
+    }
+    *ev = event_ring[tail & (EVENT_RING_SIZE - 1)];
+    /* the event is read before its slot is released */
+    __atomic_store_n(&event_tail, (uint8_t)(tail + 1), __ATOMIC_RELEASE);
+    return 0;
+err:
+    return -1;
+}
+
+uint32_t dfuusb_event_dropped(void)
+{
+    return event_drops;
+}
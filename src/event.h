@@ -0,0 +1,57 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_EVENT_H_
+#define DFUUSB_EVENT_H_
+
+#include "libc/types.h"
+
+/*
+ * Events from the USB control plane (libusbctrl callbacks and vendor
+ * requests, executed in ISR context) to the main thread, through a
+ * single producer, single consumer lock-free ring. Events are handled in
+ * order and never merged.
+ */
+typedef enum {
+    DFUUSB_EV_RESET = 0,        /* USB reset */
+    DFUUSB_EV_SET_CONFIG,       /* SetConfiguration */
+    DFUUSB_EV_UPLOAD_OFFSET,    /* arg: upload offset, in blocks */
+    DFUUSB_EV_TARGET,           /* arg: target image, images following << 8 */
+    DFUUSB_EV_NUM
+} t_dfuusb_event_type;
+
+typedef struct {
+    uint8_t  type;
+    uint32_t arg;
+} t_dfuusb_event;
+
+/* producer side (ISR) */
+int dfuusb_event_push(t_dfuusb_event_type type, uint32_t arg);
+
+/* consumer side (main thread) */
+int dfuusb_event_pop(t_dfuusb_event *ev);
+
+uint32_t dfuusb_event_dropped(void);
+
+#endif/*!DFUUSB_EVENT_H_*/
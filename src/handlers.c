@@ -30,67 +30,327 @@
 #include "libc/syscall.h"
 #include "wookey_ipc.h"
 #include "main.h"
+#include "dmashm.h"
+#include "ipc_ext.h"
+#include "stats.h"
+#include "crc32.h"
+#include "perf.h"
+#include "digest.h"
+#include "trace.h"
 #include "libfw.h"
 #include "dfu.h"
 
-#define DFU_HEADER_LEN 256
+/*
+ * DFU transfer size (power of two) and its log2. wsize is the size given
+ * to libdfu (wTransferSize), size the one of the current session, which
+ * may be smaller when negotiated against the image crypto chunk size.
+ */
+static struct {
+    uint16_t size;
+    uint8_t  shift;
+    uint16_t wsize;
+    uint16_t negotiated;    /* advised to the host, 0 if none */
+} xfer = { DFU_XFER_SIZE_MAX, __builtin_ctz(DFU_XFER_SIZE_MAX), DFU_XFER_SIZE_MAX, 0 };
+
+static inline bool dfu_xfer_size_valid(uint16_t size)
+{
+    return size != 0 && (size & (size - 1)) == 0 &&
+           size >= DFU_HEADER_LEN && size <= DFU_XFER_SIZE_MAX;
+}
+
+static void dfu_xfer_size_apply(uint16_t size)
+{
+    xfer.size = size;
+    xfer.shift = __builtin_ctz(size);
+}
+
+uint16_t dfu_handler_get_xfer_size(void)
+{
+    return xfer.size;
+}
+
+void dfu_handler_get_xfer_info(t_dfu_xfer_info *info)
+{
+    info->wsize = xfer.wsize;
+    info->size = xfer.size;
+    info->negotiated = xfer.negotiated;
+}
+
+/*
+ * The image crypto chunk is not a multiple of the current transfer size:
+ * the largest power of two dividing it, bounded by the buffer, is advised
+ * to the host, which restarts the download at block 0 with it.
+ */
+static void dfu_negotiate_xfer_size(uint16_t crypto_sz)
+{
+    uint16_t size = crypto_sz & (uint16_t)(~crypto_sz + 1);
+
+    if (size > xfer.wsize) {
+        size = xfer.wsize;
+    }
+    if (!dfu_xfer_size_valid(size)) {
+        size = 0;
+    }
+    xfer.negotiated = size;
+    if (size) {
+        TRACE_INFO(TRACE_EV_XFER_NEGOTIATED, crypto_sz, size);
+    }
+}
+
+/*
+ * Block 0: the negotiated transfer size is used if the host sends blocks
+ * of this size, the libdfu one otherwise.
+ */
+static void dfu_xfer_size_select(uint16_t block0_size)
+{
+    if (xfer.negotiated != 0 && block0_size == xfer.negotiated) {
+        dfu_xfer_size_apply(xfer.negotiated);
+    } else {
+        dfu_xfer_size_apply(xfer.wsize);
+    }
+}
+
+/*
+ * Download geometry, in DFU blocks, set once the crypto chunk size is known.
+ * The crypto chunk size being a multiple of the (power of two) DFU transfer
+ * size, block to crypto chunk conversions are shifts and masks when the
+ * crypto chunk size is a power of two too.
+ */
+#define GEOMETRY_NO_SHIFT 0xff
 
-#define DFU_MAX_CHUNK_LEN 65536
+static struct {
+    uint16_t blocks_per_chunk;
+    uint8_t  chunk_shift;
+} geometry = { 0, GEOMETRY_NO_SHIFT };
 
-#define DFU_USB_DEBUG 0
+static inline uint16_t dfu_block_to_chunk(uint16_t blocknum)
+{
+    if (geometry.chunk_shift != GEOMETRY_NO_SHIFT) {
+        return blocknum >> geometry.chunk_shift;
+    }
+    return blocknum / geometry.blocks_per_chunk;
+}
 
-extern volatile uint16_t crypto_chunk_size;
-extern volatile uint16_t dfu_usb_chunk_size;
+static inline uint16_t dfu_block_in_chunk(uint16_t blocknum)
+{
+    if (geometry.chunk_shift != GEOMETRY_NO_SHIFT) {
+        return blocknum & (geometry.blocks_per_chunk - 1);
+    }
+    return blocknum % geometry.blocks_per_chunk;
+}
 
 /* this is the DFU header than need to be sent to SMART for verification */
+#if CONFIG_APP_DFUUSB_HEADER_XFER_SHM
+/* the header is assembled in its DMA SHM region, where dfucrypto reads it */
+_Static_assert(DMASHM_HEADER_SIZE >= DFU_HEADER_LEN, "DMA SHM header region too small");
+
+static inline uint8_t *get_dfu_header(void)
+{
+    return dmashm_get_header();
+}
+#else
 static uint8_t dfu_header[DFU_HEADER_LEN] = { 0 };
 
+static inline uint8_t *get_dfu_header(void)
+{
+    return dfu_header;
+}
+#endif
+
 /* when starting, dfu_header is empty, waiting for the host to send it */
 static uint16_t current_header_offset = 0;
 
+_Static_assert(DFU_HEADER_LEN >= sizeof(firmware_header_t), "DFU header too small for a firmware header");
+
+/* header parsed once fully received, valid if it passed the local checks */
+static struct {
+    bool              valid;
+    firmware_header_t hdr;
+} parsed_header = { 0 };
+
 static volatile uint16_t current_data_size = 0;
 static volatile uint16_t current_blocknum = 0;
 static volatile uint16_t current_crypto_block_num = 1;
 
 static volatile bool is_last_block = false;
 
+/* set when the ring is full: the store of the last block is acknowledged
+ * to libdfu only once dfucrypto releases a slot */
+static volatile bool store_pending = false;
+
+/* payload blocks received into the ring during the header authentication */
+#if CONFIG_APP_DFUUSB_AUTH_BUFFERING && DMASHM_RING_SLOTS
+# define AUTH_BUFFERING 1
+static struct {
+    uint8_t  count;
+    uint8_t  slot[DMASHM_RING_SLOTS];
+    uint16_t blocknum[DMASHM_RING_SLOTS];
+    uint16_t size[DMASHM_RING_SLOTS];
+} auth_buf = { 0 };
+
+static void dfu_auth_reset(void);
+#else
+# define AUTH_BUFFERING 0
+#endif
+
+/* consecutive blocks gathered in contiguous ring slots, stored at once */
+#if CONFIG_APP_DFUUSB_COALESCE && (DMASHM_RING_SLOTS > 1)
+# define COALESCE 1
+static struct {
+    uint8_t  slot;      /* first slot */
+    uint8_t  blocks;    /* 0 if no block is gathered */
+    uint16_t blocknum;  /* first block */
+    uint16_t size;
+} span = { 0 };
+/* number of slots of the store request starting at each slot */
+static uint8_t span_slots[DMASHM_SLOTS];
+/* store requests sent to dfucrypto, not acknowledged yet */
+static uint8_t span_requests = 0;
+
+static int dfu_span_flush(void);
+static void dfu_span_drop(void);
+#else
+# define COALESCE 0
+#endif
+
 /***********************************************************
  * DFU header and application level protocol implementation
  **********************************************************/
 volatile bool dfu_reset_asked = false;
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+/* images following the current one in the session */
+static volatile uint8_t images_following = 0;
+/* a new target must be selected before the next image */
+static volatile bool target_required = false;
+/* target selected by the host, not yet sent to dfucrypto */
+static volatile bool target_changed = false;
+static volatile uint8_t next_target = 0;
+/* reboot asked by libdfu while images follow, done if none comes */
+static volatile bool reset_deferred = false;
+static uint64_t reset_deferred_ts = 0;
+
+static int dfu_send_target(void);
+#endif
+
 void dfu_reset_device(void)
 {
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+    /* the reboot only happens after the last image */
+    if (images_following) {
+        reset_deferred = true;
+        sys_get_systick(&reset_deferred_ts, PREC_MILLI);
+        return;
+    }
+#endif
 	dfu_reset_asked = true;
 }
 
+#if CONFIG_APP_DFUUSB_RESUME
+/*
+ * Resume record: blocks [0, committed_blocks[ have been acknowledged by
+ * dfucrypto (stores are acknowledged in order). After a USB reset, the
+ * authenticated session is kept and the host can continue from the first
+ * block of the first uncommitted crypto chunk.
+ */
+static volatile uint16_t committed_blocks = 0;
+static volatile bool resuming = false;
+/* block number stored in each DMA SHM slot in flight */
+static uint16_t slot_blocknum[DMASHM_SLOTS];
+
+static inline uint16_t dfu_resume_block(void)
+{
+    if (geometry.blocks_per_chunk == 0) {
+        return 0;
+    }
+    return dfu_block_to_chunk(committed_blocks) * geometry.blocks_per_chunk;
+}
+
+void dfu_handler_get_resume_info(t_dfu_resume_info *info)
+{
+    info->state = get_task_state();
+    info->resumable = (get_task_state() == DFUUSB_STATE_DWNLOAD) ? 1 : 0;
+    info->resume_block = dfu_resume_block();
+    info->committed_chunks = (geometry.blocks_per_chunk == 0) ? 0 : dfu_block_to_chunk(committed_blocks);
+    info->xfer_size = xfer.size;
+    info->committed_bytes = (uint32_t)committed_blocks << xfer.shift;
+}
+
+/* first block received after a USB reset: continuing the current session */
+static int dfu_resume_download(uint16_t blocknum)
+{
+    if (get_task_state() != DFUUSB_STATE_DWNLOAD) {
+        goto err;
+    }
+    /* resuming at a crypto chunk boundary, without skipping uncommitted data */
+    if (dfu_block_in_chunk(blocknum) != 0 || blocknum > dfu_resume_block()) {
+        goto err;
+    }
+    is_last_block = false;
+    committed_blocks = blocknum;
+    /* already digested blocks may be sent again */
+    digest_invalidate();
+    return 0;
+err:
+    return -1;
+}
+#endif
+
+/* Set the download geometry from the crypto chunk size received from dfucrypto */
+int dfu_handler_set_crypto_chunk_size(uint16_t crypto_sz)
+{
+	if(dfu_crypto_chunk_size_sanity_check(xfer.size, crypto_sz)){
+		dfu_negotiate_xfer_size(crypto_sz);
+		goto err;
+	}
+	geometry.blocks_per_chunk = crypto_sz >> xfer.shift;
+	if((geometry.blocks_per_chunk & (geometry.blocks_per_chunk - 1)) == 0){
+		geometry.chunk_shift = __builtin_ctz(geometry.blocks_per_chunk);
+	}
+	else{
+		geometry.chunk_shift = GEOMETRY_NO_SHIFT;
+	}
+#if CONFIG_APP_DFUUSB_RESUME
+	/* the header crypto chunk is authenticated */
+	committed_blocks = geometry.blocks_per_chunk;
+#endif
+	stats_set_chunk_size(crypto_sz);
+	return 0;
+err:
+	geometry.blocks_per_chunk = 0;
+	return -1;
+}
+
 /* Sanity check that we are asked for proper pseudo-sequential crypto blocks.
  */
-static int dnload_transfers_sanity_check(uint32_t curr_block_index, uint16_t curr_transfer_size){
-	if(dfu_crypto_chunk_size_sanity_check(dfu_usb_chunk_size, crypto_chunk_size)){
-		printf("Error: sanity check on DFU (%d) and crypto (%d) chunk sizes failed!\n", dfu_usb_chunk_size, crypto_chunk_size);
+static int dnload_transfers_sanity_check(uint16_t curr_block_index, uint16_t curr_transfer_size, uint8_t *reason){
+	if(geometry.blocks_per_chunk == 0){
+		TRACE_ERR(TRACE_EV_SANITY_ERR, TRACE_SANITY_GEOMETRY, curr_block_index);
+		*reason = TRACE_SANITY_GEOMETRY;
 		goto err;
 	}
 	/* There is no reason to get the header here ... */
-	uint32_t curr_block_offset = (uint32_t)curr_block_index * (uint32_t)dfu_usb_chunk_size;
-	if(curr_block_offset < (uint32_t)crypto_chunk_size){
-		printf("Error: sanity check failed, sending block %d in crypto header!\n", curr_block_index);
+	if(curr_block_index < geometry.blocks_per_chunk){
+		TRACE_ERR(TRACE_EV_SANITY_ERR, TRACE_SANITY_HEADER_CHUNK, curr_block_index);
+		*reason = TRACE_SANITY_HEADER_CHUNK;
 		goto err;
 	}
-	/* We have to be aligned on the dfu_usb_chunk_size except for the last transfer! */
-	if((curr_transfer_size != dfu_usb_chunk_size) && (is_last_block == true)){
-		printf("Error: sanity check on DFU (%d) and current chunk (%d) sizes failed!\n", dfu_usb_chunk_size, curr_transfer_size);
+	/* We have to be aligned on the DFU transfer size except for the last transfer! */
+	if((curr_transfer_size != xfer.size) && (is_last_block == true)){
+		TRACE_ERR(TRACE_EV_SANITY_ERR, TRACE_SANITY_SIZE, curr_block_index);
+		*reason = TRACE_SANITY_SIZE;
 		goto err;
 	}
-	else if(curr_transfer_size != dfu_usb_chunk_size){
+	else if(curr_transfer_size != xfer.size){
 		is_last_block = true;
 	}
 	/* Check that we are asked to decrypt a dfu block inside a crypto block where we have started a decrypt session ... */
-	if((curr_block_offset % (uint32_t)crypto_chunk_size) == 0){
-		current_crypto_block_num = curr_block_offset / crypto_chunk_size;
+	if(dfu_block_in_chunk(curr_block_index) == 0){
+		current_crypto_block_num = dfu_block_to_chunk(curr_block_index);
 	}
 	else{
-		if((curr_block_offset / crypto_chunk_size) != current_crypto_block_num){
-			printf("Error: sanity check on DFU block numbers failed! (current=%d, not in current decrypt session started at block %d))\n", curr_block_index, current_crypto_block_num);
+		if(dfu_block_to_chunk(curr_block_index) != current_crypto_block_num){
+			TRACE_ERR(TRACE_EV_SANITY_ERR, TRACE_SANITY_SEQUENCE, curr_block_index);
+			*reason = TRACE_SANITY_SEQUENCE;
 			goto err;
 		}
 	}
@@ -103,52 +363,277 @@ err:
 /* authenticate header with smart */
 static inline void dfu_init_header_authentication(void)
 {
-    uint16_t offset = 0;
-    uint16_t residual = 0;
+#if CONFIG_APP_DFUUSB_HEADER_XFER_SHM
     struct sync_command_data sync_command_rw;
+#else
+    /* a whole IPC message, larger than struct sync_command_data */
+    t_dfuusb_ipc_msg header_msg;
+#endif
 
-#if DFU_USB_DEBUG
+    /* up to the header validation by dfucrypto */
+    stats_wait_begin();
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
     printf("printing header before sending...\n");
-    firmware_print_header((firmware_header_t *)dfu_header);
+    firmware_print_header((firmware_header_t *)get_dfu_header());
     printf("end of header printing...\n");
 #endif
+#if CONFIG_APP_DFUUSB_HEADER_XFER_SHM
+    /* the header is already in the DMA SHM, only sending its descriptor */
+    sync_command_rw.magic = MAGIC_DFU_HEADER_SHM;
+    sync_command_rw.state = SYNC_DONE;
+    sync_command_rw.data_size = DFUUSB_IPC_WORDS(8);
+    sync_command_rw.data.u16[0] = (uint16_t)(get_dfu_header() - dmashm_get_buf());
+    sync_command_rw.data.u16[1] = DFU_HEADER_LEN;
+    sync_command_rw.data.u32[1] = crc32_update(0, get_dfu_header(), DFU_HEADER_LEN);
+
+    dfuusb_send_ipc(&sync_command_rw, sizeof(struct sync_command_data),
+                    DFUUSB_IPC_BYTES(sync_command_rw.data_size));
+#else
+    uint16_t offset = 0;
+    uint16_t residual = 0;
+    uint8_t fragment;
+    /* fragments use the whole IPC message with the compact framing */
+    uint8_t max_fragment = (dfuusb_ipc_version() >= 1) ? DFUUSB_IPC_PAYLOAD_MAX : 32;
+
     do {
         /* residual data to send to smart */
         residual = DFU_HEADER_LEN - offset;
+        fragment = (residual < max_fragment) ? residual : max_fragment;
 
-        sync_command_rw.magic = MAGIC_DFU_HEADER_SEND;
-        sync_command_rw.state = SYNC_DONE;
+        header_msg.magic = MAGIC_DFU_HEADER_SEND;
+        header_msg.state = SYNC_DONE;
 
-        /* copying at most 32 bytes in the IPC structure */
-        memcpy(sync_command_rw.data.u8,
-                &dfu_header[offset],
-                (residual < 32) ? residual : 32);
-        sync_command_rw.data_size = (residual < 32) ? residual : 32;
+        /* copying at most one fragment in the IPC structure */
+        memcpy(header_msg.data.u8, &get_dfu_header()[offset], fragment);
+        header_msg.data_size = fragment;
 
         /* sending the IPC */
-        sys_ipc(IPC_SEND_SYNC, get_dfucrypto_id(),
-                sizeof(struct sync_command_data),
-                (char*)&sync_command_rw);
+        dfuusb_send_ipc(&header_msg, sizeof(struct sync_command_data), fragment);
 
         /* updating the current buffer offset */
-        offset += ((residual < 32) ? residual : 32);
+        offset += fragment;
     } while (offset < DFU_HEADER_LEN);
 
     /* finishing with a ZLP IPC to smart, in order to inform it that the
      * header transmission is terminated */
-    sync_command_rw.magic = MAGIC_DFU_HEADER_SEND;
-    sync_command_rw.state = SYNC_DONE;
-    sync_command_rw.data_size = 0;
-    sys_ipc(IPC_SEND_SYNC, get_dfucrypto_id(),
-            sizeof(struct sync_command_data),
-            (char*)&sync_command_rw);
+    header_msg.magic = MAGIC_DFU_HEADER_SEND;
+    header_msg.state = SYNC_DONE;
+    header_msg.data_size = 0;
+    dfuusb_send_ipc(&header_msg, sizeof(struct sync_command_data), 0);
+#endif
+}
+
+
+/*
+ * Upload (readback) context. dfucrypto reads the flash at the requested
+ * offset and writes it into the given DMA SHM slot. Slot 0 being the libdfu
+ * buffer, a block read there is directly sent to the host. When the store
+ * ring is idle, a ring slot is taken to read the next block ahead while
+ * libdfu sends the current one to the host. The slot stays busy until the
+ * block is delivered or dropped, or until the acknowledge of a dropped
+ * read, so that no DNLOAD block is received in it meanwhile.
+ */
+static struct {
+    uint32_t offset;        /* image offset of the next block for the host */
+    uint32_t req_offset;    /* offset of the read request in progress */
+    uint16_t req_size;
+    uint8_t  req_slot;
+    bool     in_flight;     /* a read request is in progress in dfucrypto */
+    uint8_t  stale_acks;    /* acknowledges of dropped read requests */
+    bool     prefetched;    /* the prefetch slot holds the block at offset */
+    uint16_t prefetch_len;
+    uint8_t  prefetch_slot; /* ring slot taken for a read ahead, 0 if none */
+    uint8_t *host_buf;      /* libdfu buffer waiting for data, if any */
+    uint16_t host_size;
+} upload = { 0 };
+
+/* give the read ahead ring slot back */
+static void dfu_upload_release(void)
+{
+#if DMASHM_RING_SLOTS
+    if (upload.prefetch_slot != 0) {
+        /* taken with an empty ring, it is the ring tail */
+        dmashm_ring_pop(upload.prefetch_slot);
+        upload.prefetch_slot = 0;
+    }
+#endif
+}
+
+/* drop the read request in progress, if any */
+static void dfu_upload_drop(void)
+{
+    if (upload.in_flight) {
+        /* the slot of a read ahead is released on its acknowledge */
+        upload.in_flight = false;
+        upload.stale_acks++;
+    } else if (upload.prefetched) {
+        dfu_upload_release();
+    }
+    upload.prefetched = false;
+}
+
+/* Send a data-path request to dfucrypto, its payload being data_size
+ * 16-bit words */
+static e_syscall_ret dfu_send_to_crypto(struct sync_command_data *sync_command_rw)
+{
+    return dfuusb_send_ipc(sync_command_rw, sizeof(struct sync_command_data),
+                           DFUUSB_IPC_BYTES(sync_command_rw->data_size));
+}
+
+/* store request acknowledged by dfucrypto for the given DMA SHM slot */
+void dfu_handler_store_ack(uint8_t slot)
+{
+    uint8_t slots = 1;
+    uint8_t i;
+
+#if COALESCE
+    /* the acknowledge covers all the slots of the request */
+    if (slot < DMASHM_SLOTS && span_slots[slot] != 0) {
+        slots = span_slots[slot];
+        span_slots[slot] = 0;
+    }
+    if (span_requests) {
+        span_requests--;
+    }
+#endif
+    for (i = 0; i < slots; ++i) {
+        perf_block_acked(slot + i);
+        stats_block_stored();
+    }
+#if CONFIG_APP_DFUUSB_RESUME
+    if (slot + slots - 1 < DMASHM_SLOTS) {
+        committed_blocks = slot_blocknum[slot + slots - 1] + 1;
+    }
+#endif
+#if DMASHM_RING_SLOTS
+    for (i = 0; i < slots; ++i) {
+        if (dmashm_ring_pop(slot + i)) {
+            goto err;
+        }
+    }
+#if COALESCE
+    /* dfucrypto is idle: the blocks gathered meanwhile are sent at once */
+    if (span_requests == 0 && dfu_span_flush()) {
+        return;
+    }
+#endif
+    if (store_pending) {
+        store_pending = false;
+        stats_wait_end();
+        perf_block_stored();
+        dfu_store_finished();
+    }
+    return;
+err:
+    /* unexpected acknowledge: the blocks libdfu waits for may not have
+     * been stored, the session can't go on */
+    TRACE_ERR(TRACE_EV_STORE_ERR, 0, slot);
+    store_pending = false;
+    stats_wait_end();
+    dfu_leave_session_with_error(ERRWRITE);
+    set_task_state(DFUUSB_STATE_IDLE);
+#else
+    stats_wait_end();
+    perf_block_stored();
+    dfu_store_finished();
+#endif
 }
 
+/* USB reset: libdfu is reinitialized, dropping any store in progress */
+void dfu_handler_usb_reset(void)
+{
+    store_pending = false;
+#if AUTH_BUFFERING
+    dfu_auth_reset();
+#endif
+#if COALESCE
+    /* the gathered blocks have been acknowledged to the host */
+    dfu_span_flush();
+#endif
+    upload.host_buf = NULL;
+    dfu_upload_drop();
+#if CONFIG_APP_DFUUSB_RESUME
+    resuming = true;
+#endif
+}
 
 static volatile bool header_full = false;
 
 static volatile uint32_t bytes_received = 0;
 
+/*
+ * Local checks of the received header, run once before asking dfucrypto
+ * to authenticate it, so that obviously wrong images are refused at once
+ * with a DFU error. The authentication stays done by dfucrypto.
+ * Return ERRNONE if the header is acceptable.
+ */
+static dfu_status_enum_t dfu_header_check(void)
+{
+    firmware_header_t *hdr = &parsed_header.hdr;
+    uint8_t reason;
+    uint32_t field;
+    dfu_status_enum_t status = ERRFILE;
+
+    if (parsed_header.valid) {
+        return ERRNONE;
+    }
+    if (firmware_parse_header(get_dfu_header(), DFU_HEADER_LEN, 0, hdr, NULL)) {
+        reason = TRACE_HEADER_PARSE;
+        field = 0;
+        goto err;
+    }
+#if CONFIG_APP_DFUUSB_HEADER_CHECK
+    if (CONFIG_APP_DFUUSB_FW_MAGIC != 0 && hdr->magic != CONFIG_APP_DFUUSB_FW_MAGIC) {
+        reason = TRACE_HEADER_MAGIC;
+        field = hdr->magic;
+        status = ERRTARGET;
+        goto err;
+    }
+    if (CONFIG_APP_DFUUSB_FW_TYPES != 0 &&
+        (hdr->type > 31 || ((CONFIG_APP_DFUUSB_FW_TYPES >> hdr->type) & 1) == 0)) {
+        reason = TRACE_HEADER_TYPE;
+        field = hdr->type;
+        status = ERRTARGET;
+        goto err;
+    }
+#if CONFIG_APP_DFUUSB_FW_MIN_VERSION > 0
+    if (hdr->version < CONFIG_APP_DFUUSB_FW_MIN_VERSION) {
+        reason = TRACE_HEADER_VERSION;
+        field = hdr->version;
+        goto err;
+    }
+#endif
+    if (hdr->len == 0 || hdr->len > CONFIG_APP_DFUUSB_FW_MAX_LEN) {
+        reason = TRACE_HEADER_LEN;
+        field = hdr->len;
+        goto err;
+    }
+    /* the signature is part of the header */
+    if (hdr->siglen > DFU_HEADER_LEN - sizeof(firmware_header_t)) {
+        reason = TRACE_HEADER_SIGLEN;
+        field = hdr->siglen;
+        goto err;
+    }
+#endif
+    /* the header is received in the first crypto chunk */
+    if (hdr->chunksize < DFU_HEADER_LEN || hdr->chunksize > DFU_MAX_CHUNK_LEN) {
+        if (hdr->chunksize > DFU_MAX_CHUNK_LEN) {
+            TRACE_ERR(TRACE_EV_CHUNK_TOO_BIG, hdr->chunksize, DFU_MAX_CHUNK_LEN);
+        }
+        reason = TRACE_HEADER_CHUNK;
+        field = hdr->chunksize;
+        goto err;
+    }
+    parsed_header.valid = true;
+    return ERRNONE;
+err:
+    TRACE_ERR(TRACE_EV_HEADER_CHECK_ERR, reason, field);
+    /* only traced, unused with CONFIG_APP_DFUUSB_TRACE_LEVEL=0 */
+    (void)reason;
+    (void)field;
+    return status;
+}
+
 bool first_chunk_received(void)
 {
     /* cryptographic chunks must be at least of the same size
@@ -157,37 +642,365 @@ bool first_chunk_received(void)
      * while this header is not yet fully read from USB, we
      * consider that the first cryptographic chunk is *not*
      * fully received */
-    if (!header_full) {
+    if (!header_full || !parsed_header.valid) {
         return false;
     }
-    firmware_header_t header;
-    firmware_parse_header(dfu_header, DFU_HEADER_LEN, 0, &header, NULL);
-    /* Sanity check on the chunk size */
-    if(header.chunksize > DFU_MAX_CHUNK_LEN){
+    TRACE_DBG(TRACE_EV_FIRST_CHUNK, bytes_received, parsed_header.hdr.chunksize);
+    return bytes_received >= parsed_header.hdr.chunksize;
+}
+
+/* header fully received: refusing it right away if it fails the local checks */
+static int dfu_header_received(void)
+{
+    dfu_status_enum_t status;
+
+    header_full = true;
+    status = dfu_header_check();
+    if (status != ERRNONE) {
+        dfu_leave_session_with_error(status);
+        set_task_state(DFUUSB_STATE_IDLE);
+        return -1;
+    }
+    return 0;
+}
+
+
+#if CONFIG_APP_DFUUSB_CHUNK_RETRY
+/*
+ * Chunk level retry: a block refused by the sanity checks does not end
+ * the session. The crypto chunk in progress is reported as failed and
+ * the host can send it again (or any previous one) from its first block,
+ * dfucrypto restarting a decrypt session on each crypto chunk boundary.
+ */
+static volatile uint16_t failed_chunk = 0;
+static volatile uint8_t failed_reason = 0;
+
+void dfu_handler_get_recovery_info(t_dfu_recovery_info *info)
+{
+    info->state = get_task_state();
+    info->reason = failed_reason;
+    info->failed_chunk = failed_chunk;
+    info->restart_block = failed_chunk * geometry.blocks_per_chunk;
+    info->xfer_size = xfer.size;
+}
+
+static void dfu_enter_recovery(uint16_t blocknum, uint8_t reason)
+{
+    uint16_t chunk;
+
+    /* nothing to retry before the header chunk is validated */
+    if (geometry.blocks_per_chunk == 0 || blocknum < geometry.blocks_per_chunk) {
+        dfu_leave_session_with_error(ERRFILE);
+        set_task_state(DFUUSB_STATE_IDLE);
+        return;
+    }
+    chunk = dfu_block_to_chunk(blocknum);
+    failed_chunk = (chunk < current_crypto_block_num) ? chunk : current_crypto_block_num;
+    failed_reason = reason;
+    /* blocks in flight are released by their acknowledge */
+    store_pending = false;
+#if COALESCE
+    dfu_span_drop();
+#endif
+    digest_invalidate();
+    TRACE_ERR(TRACE_EV_RECOVER, failed_chunk, reason);
+    set_task_state(DFUUSB_STATE_RECOVER);
+    dfu_leave_session_with_error(ERRADDRESS);
+}
 
-        struct sync_command_data sync_command;
-#if DFU_USB_DEBUG
-        printf("Max chunk size %d exceeds limit %d!\n", header.chunksize, DFU_MAX_CHUNK_LEN);
+/* first block after a failure: restarting a crypto chunk not after the failed one */
+static int dfu_recover_download(uint16_t blocknum)
+{
+    if (dfu_block_in_chunk(blocknum) != 0 ||
+        blocknum < geometry.blocks_per_chunk ||
+        dfu_block_to_chunk(blocknum) > failed_chunk) {
+        goto err;
+    }
+    is_last_block = false;
+#if CONFIG_APP_DFUUSB_RESUME
+    if (blocknum < committed_blocks) {
+        committed_blocks = blocknum;
+    }
 #endif
-        /* corrupted header received, response through reset request to security monitor */
-        sync_command.magic = MAGIC_REBOOT_REQUEST;
-        sync_command.state = SYNC_WAIT;
-        sys_ipc(IPC_SEND_SYNC, get_dfucrypto_id(),
-                    sizeof(struct sync_command),
-                    (char*)&sync_command);
+    set_task_state(DFUUSB_STATE_DWNLOAD);
+    return 0;
+err:
+    return -1;
+}
+#endif
+
+/* refused DNLOAD block */
+static void dfu_refuse_block(uint16_t blocknum, uint16_t data_size, uint8_t reason)
+{
+    TRACE_ERR(TRACE_EV_BLOCK_REFUSED, blocknum, data_size);
+    stats_sanity_reject();
+#if CONFIG_APP_DFUUSB_CHUNK_RETRY
+    dfu_enter_recovery(blocknum, reason);
+#else
+    reason = reason;
+    dfu_leave_session_with_error(ERRFILE);
+    set_task_state(DFUUSB_STATE_IDLE);
+#endif
+}
+
+/*
+ * A store request could not be sent: its slot and the following ones,
+ * which have not been handed to dfucrypto either, are released, as they
+ * will never be acknowledged.
+ */
+static void dfu_store_failed(uint16_t blocknum, uint8_t slot)
+{
+    TRACE_ERR(TRACE_EV_STORE_ERR, blocknum, slot);
+#if DMASHM_RING_SLOTS
+    dmashm_ring_cancel_from(slot);
+#endif
+#if COALESCE
+    span.blocks = 0;
+    span_slots[slot] = 0;
+#endif
+#if AUTH_BUFFERING
+    auth_buf.count = 0;
+#endif
+    store_pending = false;
+    stats_wait_end();
+    dfu_leave_session_with_error(ERRWRITE);
+    set_task_state(DFUUSB_STATE_IDLE);
+}
+
+/* ask dfucrypto to store data_size bytes from the given DMA SHM slot */
+static int dfu_store_request(uint16_t data_size, uint16_t blocknum, uint8_t slot)
+{
+    struct sync_command_data sync_command_rw;
+
+    /* sending DMA request for the whole buffer to Crypto */
+    sync_command_rw.magic = MAGIC_DATA_WR_DMA_REQ;
+    sync_command_rw.state = SYNC_ASK_FOR_DATA;
+    sync_command_rw.data_size = 2;
+    sync_command_rw.data.u16[0] = data_size;
+    /* The block number we send is the block number where we have discarded the header
+     * (the sanity check ensures that we are past the header crypto chunk) */
+    sync_command_rw.data.u16[1] = blocknum - geometry.blocks_per_chunk;
+#if DMASHM_RING_SLOTS
+    sync_command_rw.data_size = 3;
+    sync_command_rw.data.u16[2] = slot;
+#endif
+    if (dfu_send_to_crypto(&sync_command_rw) != SYS_E_DONE) {
+        dfu_store_failed(blocknum, slot);
+        return -1;
+    }
+    perf_block_requested(slot);
+    return 0;
+}
+
+#if COALESCE
+/* one store request for all the gathered blocks */
+static int dfu_span_flush(void)
+{
+    uint8_t i;
+
+    if (span.blocks == 0) {
+        return 0;
+    }
+    span_slots[span.slot] = span.blocks;
+    if (dfu_store_request(span.size, span.blocknum, span.slot)) {
+        return -1;
+    }
+    for (i = 1; i < span.blocks; ++i) {
+        perf_block_requested(span.slot + i);
+    }
+    span.blocks = 0;
+    span_requests++;
+    return 0;
+}
+
+/* release the slots of the gathered blocks, not sent to dfucrypto */
+static void dfu_span_drop(void)
+{
+    while (span.blocks) {
+        span.blocks--;
+        dmashm_ring_cancel(span.slot + span.blocks);
     }
-    if (bytes_received >= header.chunksize) {
-#if DFU_USB_DEBUG
-        printf("first crypto chunk received ! bytes read: %x / %x\n", bytes_received, header.chunksize);
+}
+#endif
+
+/* hand a block, received in the given DMA SHM slot, to dfucrypto.
+ * On error, the session is left and the block slot is released. */
+static int dfu_store_block(const uint8_t *data, uint16_t data_size,
+                           uint16_t blocknum, uint8_t slot)
+{
+    /* digest of the exact bytes forwarded to dfucrypto */
+    digest_update(data, data_size);
+#if CONFIG_APP_DFUUSB_RESUME
+    slot_blocknum[slot] = blocknum;
+#endif
+#if COALESCE
+    /* a request covers contiguous slots and blocks of a single crypto chunk */
+    if (span.blocks != 0 &&
+        (slot != span.slot + span.blocks ||
+         blocknum != span.blocknum + span.blocks ||
+         dfu_block_in_chunk(blocknum) == 0)) {
+        /* the block slot, pushed after the gathered ones, is released too */
+        if (dfu_span_flush()) {
+            return -1;
+        }
+    }
+    if (span.blocks == 0) {
+        span.slot = slot;
+        span.blocknum = blocknum;
+        span.size = 0;
+    }
+    span.blocks++;
+    span.size += data_size;
+    /* Blocks are only gathered while dfucrypto is busy with a previous
+     * request, not to leave it idle. Otherwise sent at end of crypto
+     * chunk, last block, no slot left for the host, or blocks not
+     * filling the slots (not contiguous) */
+    if (span_requests == 0 ||
+        dfu_block_in_chunk(blocknum) == geometry.blocks_per_chunk - 1 ||
+        data_size != xfer.size || dmashm_ring_full() ||
+        xfer.size != DMASHM_SLOT_SIZE) {
+        return dfu_span_flush();
+    }
+    return 0;
+#else
+    return dfu_store_request(data_size, blocknum, slot);
 #endif
-        return true;
+}
+
+#if DMASHM_RING_SLOTS
+/* the block is in the ring: the host can send the next one if a slot is free */
+static void dfu_store_release_host(void)
+{
+    if (dmashm_ring_full()) {
+        store_pending = true;
+        stats_wait_begin();
+    } else {
+        perf_block_stored();
+        dfu_store_finished();
     }
-#if DFU_USB_DEBUG
-    printf("first crypto chunk not received ! bytes read: %x / %x\n", bytes_received, header.chunksize);
+}
+
+/*
+ * No free ring slot for a received block. The host is only released while
+ * a slot is free, but the slots of blocks sent before a restart (block 0
+ * or chunk recovery) are released by their acknowledge only. The block
+ * can't be stored: the session is left instead of dropping it.
+ */
+static void dfu_store_no_slot(uint16_t blocknum)
+{
+    TRACE_ERR(TRACE_EV_NO_SLOT, blocknum, dmashm_ring_count());
+    store_pending = false;
+    dfu_leave_session_with_error(ERRWRITE);
+    set_task_state(DFUUSB_STATE_IDLE);
+}
 #endif
-    return false;
+
+#if AUTH_BUFFERING
+/*
+ * Speculative buffering: while dfucrypto authenticates the header, the
+ * following blocks are received into the ring, without being handed to
+ * dfucrypto. They are checked and sent once the header is validated, or
+ * dropped if it is not.
+ */
+/* the host has been released on authentication start */
+static volatile bool auth_released = false;
+
+static void dfu_auth_release_host(void)
+{
+    auth_released = true;
+    stats_wait_end();
+    dfu_store_finished();
 }
 
+static void dfu_auth_buffer_block(const uint8_t *data, uint16_t data_size, uint16_t blocknum)
+{
+    uint8_t slot;
+
+    if (auth_buf.count >= DMASHM_RING_SLOTS || dmashm_ring_push(&slot)) {
+        /* the blocks already buffered are dropped with the session */
+        dfu_auth_reset();
+        dfu_store_no_slot(blocknum);
+        return;
+    }
+    memcpy(dmashm_get_slot(slot), data, data_size);
+    auth_buf.slot[auth_buf.count] = slot;
+    auth_buf.blocknum[auth_buf.count] = blocknum;
+    auth_buf.size[auth_buf.count] = data_size;
+    auth_buf.count++;
+    TRACE_DBG(TRACE_EV_AUTH_BUFFERED, blocknum, auth_buf.count);
+    dfu_store_release_host();
+}
+
+/* drop the buffered blocks, from the newest */
+static void dfu_auth_drop(void)
+{
+    while (auth_buf.count) {
+        auth_buf.count--;
+        dmashm_ring_cancel(auth_buf.slot[auth_buf.count]);
+    }
+}
+
+/* new download or USB reset: the authentication is done again */
+static void dfu_auth_reset(void)
+{
+    dfu_auth_drop();
+    auth_released = false;
+}
+
+/* the header is validated: sending the buffered blocks to dfucrypto */
+static void dfu_auth_forward(void)
+{
+    uint8_t reason = 0;
+    uint8_t i;
+
+    for (i = 0; i < auth_buf.count; ++i) {
+        if (dnload_transfers_sanity_check(auth_buf.blocknum[i], auth_buf.size[i], &reason)) {
+            /* the refused block and the following ones are dropped */
+            while (auth_buf.count > i) {
+                auth_buf.count--;
+                dmashm_ring_cancel(auth_buf.slot[auth_buf.count]);
+            }
+            auth_buf.count = 0;
+            dfu_refuse_block(auth_buf.blocknum[i], auth_buf.size[i], reason);
+            return;
+        }
+        if (dfu_store_block(dmashm_get_slot(auth_buf.slot[i]), auth_buf.size[i],
+                            auth_buf.blocknum[i], auth_buf.slot[i])) {
+            /* the following blocks have been released too */
+            return;
+        }
+    }
+    auth_buf.count = 0;
+}
+#endif
+
+/*
+ * End of the header authentication by dfucrypto. When valid, the download
+ * geometry must have been set before.
+ */
+void dfu_handler_auth_end(bool valid)
+{
+#if AUTH_BUFFERING
+    bool released = auth_released;
+
+    auth_released = false;
+    if (valid) {
+        dfu_auth_forward();
+        if (!released) {
+            dfu_store_finished();
+        }
+        return;
+    }
+    dfu_auth_drop();
+    if (!released || store_pending) {
+        store_pending = false;
+        dfu_store_finished();
+    }
+#else
+    valid = valid;
+    dfu_store_finished();
+#endif
+}
 
 /***********************************************************
  * DFU API backend access implementation
@@ -201,28 +1014,73 @@ uint8_t dfu_backend_write(uint8_t * volatile data,
                           uint16_t            blocknum)
 {
     t_dfuusb_state state;
-    struct sync_command_data sync_command_rw;
     current_data_size = data_size;
     current_blocknum  = blocknum;
 
-#if DFU_USB_DEBUG
-    printf("writing data (block: %d) size: %d\n", blocknum, data_size);
+    perf_block_received();
+    stats_block_received(data_size);
+
+#if CONFIG_APP_DFUUSB_RESUME
+    if (resuming && blocknum != 0 && get_task_state() != DFUUSB_STATE_RECOVER) {
+        resuming = false;
+        if (dfu_resume_download(blocknum)) {
+            TRACE_ERR(TRACE_EV_RESUME_ERR, blocknum, dfu_resume_block());
+            dfu_leave_session_with_error(ERRADDRESS);
+            return 0;
+        }
+    }
+    resuming = false;
 #endif
+    TRACE_DBG(TRACE_EV_WRITE, blocknum, data_size);
 
     /* If we were in the middle of a transfer, and we receive block 0 again, this means
      * that we have to reset our state machine.
      */
     if(blocknum == 0){
-#if DFU_USB_DEBUG
-        printf("DFU block 0 received, resetting state machine to IDLE\n");
+        TRACE_DBG(TRACE_EV_BLOCK0, 0, 0);
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+        reset_deferred = false;
+        if (target_required || dfu_send_target()) {
+            TRACE_ERR(TRACE_EV_TARGET_ERR, next_target, images_following);
+            dfu_leave_session_with_error(ERRTARGET);
+            return 0;
+        }
 #endif
+        dfu_xfer_size_select(data_size);
     	bytes_received = 0;
+        header_full = false;
+        parsed_header.valid = false;
+        current_header_offset = 0;
         /* Reinit our variable handling the possible last block */
         is_last_block = false;
         current_crypto_block_num = 1;
+        /* geometry is set again when the new header is validated */
+        geometry.blocks_per_chunk = 0;
+        /* blocks still in the ring are released by their acknowledge */
+        store_pending = false;
+#if AUTH_BUFFERING
+        dfu_auth_reset();
+#endif
+#if COALESCE
+        dfu_span_drop();
+#endif
+        dfu_upload_drop();
+        upload.offset = 0;
+        perf_reset();
+        stats_reset();
+        digest_reset();
 	set_task_state(DFUUSB_STATE_IDLE);
     }
 
+#if CONFIG_APP_DFUUSB_CHUNK_RETRY
+    if (get_task_state() == DFUUSB_STATE_RECOVER) {
+        if (dfu_recover_download(blocknum)) {
+            TRACE_ERR(TRACE_EV_RECOVER_ERR, blocknum, failed_chunk);
+            dfu_leave_session_with_error(ERRADDRESS);
+            return 0;
+        }
+    }
+#endif
     bytes_received += data_size;
     state = get_task_state();
     switch (state) {
@@ -230,12 +1088,17 @@ uint8_t dfu_backend_write(uint8_t * volatile data,
         {
             if (data_size >= DFU_HEADER_LEN) {
                 /* header has been sent in one time */
-                memcpy(dfu_header, data, DFU_HEADER_LEN);
-                header_full = true;
+                memcpy(get_dfu_header(), data, DFU_HEADER_LEN);
+                if (dfu_header_received()) {
+                    break;
+                }
                 /* asking smart for header authentication */
                 if (first_chunk_received()) {
                     set_task_state(DFUUSB_STATE_AUTH);
                     dfu_init_header_authentication();
+#if AUTH_BUFFERING
+                    dfu_auth_release_host();
+#endif
                 } else {
                     /* going to GETHEADER to finish crypto chunk reception */
                     set_task_state(DFUUSB_STATE_GETHEADER);
@@ -243,7 +1106,7 @@ uint8_t dfu_backend_write(uint8_t * volatile data,
                 }
             } else {
                 /* header must be generated with multiple chunks */
-                memcpy(dfu_header, data, data_size);
+                memcpy(get_dfu_header(), data, data_size);
                 current_header_offset += data_size;
                 set_task_state(DFUUSB_STATE_GETHEADER);
                 dfu_store_finished();
@@ -264,53 +1127,70 @@ uint8_t dfu_backend_write(uint8_t * volatile data,
             if (data_size >= (DFU_HEADER_LEN - (current_header_offset))) {
                 /* enough bytes received to fullfill the header */
                 if (!header_full) {
-                    memcpy(&dfu_header[current_header_offset], data, DFU_HEADER_LEN - current_header_offset);
+                    memcpy(&get_dfu_header()[current_header_offset], data, DFU_HEADER_LEN - current_header_offset);
                     current_header_offset += (DFU_HEADER_LEN - current_header_offset);
-                    header_full = true;
+                    if (dfu_header_received()) {
+                        break;
+                    }
                     dfu_store_finished();
                 }
                 if (first_chunk_received()) {
                     set_task_state(DFUUSB_STATE_AUTH);
                     dfu_init_header_authentication();
+#if AUTH_BUFFERING
+                    dfu_auth_release_host();
+#endif
                 } else {
                     dfu_store_finished();
                 }
             } else {
-                memcpy(&dfu_header[current_header_offset], data, data_size);
+                memcpy(&get_dfu_header()[current_header_offset], data, data_size);
                 current_header_offset += data_size;
                 dfu_store_finished();
                 /* continuing during next call... */
             }
             break;
         }
+#if AUTH_BUFFERING
+        case DFUUSB_STATE_AUTH:
+        {
+            dfu_auth_buffer_block(data, data_size, blocknum);
+            break;
+        }
+#endif
         case DFUUSB_STATE_DWNLOAD:
         {
 	    /* Sanity check */
-	    if(dnload_transfers_sanity_check(blocknum, data_size)){
-		printf("Error: sanity check error when performing DFUUSB_STATE_DWNLOAD. Block %d of size %d is refused!\n", blocknum, data_size);
-		break;
-	    }
-            /* sending DMA request for the whole buffer to Crypto */
-            sync_command_rw.magic = MAGIC_DATA_WR_DMA_REQ;
-            sync_command_rw.state = SYNC_ASK_FOR_DATA;
-            sync_command_rw.data_size = 2;
-            sync_command_rw.data.u16[0] = data_size;
-	    /* The block number we send is the block number where we have discarded the header */
-	    if(blocknum < (crypto_chunk_size / dfu_usb_chunk_size)){
-		/* Sanity check (even if it should have been performed earlier, better safe than sorry ...) */
-		printf("Error: sanity check error on block number %d\n", blocknum);
+	    uint8_t reason = 0;
+	    if(dnload_transfers_sanity_check(blocknum, data_size, &reason)){
+		dfu_refuse_block(blocknum, data_size, reason);
 		break;
 	    }
-            sync_command_rw.data.u16[1] = blocknum - (crypto_chunk_size / dfu_usb_chunk_size);
-
-            sys_ipc(IPC_SEND_SYNC, get_dfucrypto_id(),
-                    sizeof(struct sync_command_data),
-                    (char*)&sync_command_rw);
 
+            uint8_t slot = 0;
+#if DMASHM_RING_SLOTS
+            /* copying the block into the ring, releasing the libdfu buffer */
+            if (dmashm_ring_push(&slot)) {
+                dfu_store_no_slot(blocknum);
+                break;
+            }
+            memcpy(dmashm_get_slot(slot), data, data_size);
+#endif
+            if (dfu_store_block(data, data_size, blocknum, slot)) {
+                break;
+            }
+#if DMASHM_RING_SLOTS
+            /* let the host send the next block while dfucrypto is working,
+             * as long as there is a free slot to receive it */
+            dfu_store_release_host();
+#else
+            /* the block is stored in place, from the libdfu buffer */
+            stats_wait_begin();
+#endif
             break;
         }
         default: {
-            printf("Error! write callback should not be called in %x state\n", get_task_state());
+            TRACE_ERR(TRACE_EV_BAD_STATE, get_task_state(), blocknum);
             break;
         }
     }
@@ -319,52 +1199,291 @@ uint8_t dfu_backend_write(uint8_t * volatile data,
     return 0;
 }
 
-uint32_t flash_block = 0;
-
-uint8_t dfu_backend_read(uint8_t *data, uint16_t data_size)
+static void dfu_upload_request(uint32_t offset, uint16_t size, uint8_t slot)
 {
     struct sync_command_data sync_command_rw;
 
-#if DFU_USB_DEBUG
-    printf("reading data (@: %x) size: %d from flash\n", data, data_size);
-#endif
+    upload.req_offset = offset;
+    upload.req_size = size;
+    upload.req_slot = slot;
+    upload.in_flight = true;
 
-    memset(data, flash_block, data_size);
-    flash_block++;
     sync_command_rw.magic = MAGIC_DATA_RD_DMA_REQ;
     sync_command_rw.state = SYNC_ASK_FOR_DATA;
-    sync_command_rw.data_size = 1;
-    sync_command_rw.data.u16[0] = data_size;
-// fixme no field for DFU... ?    sync_command_rw.sector_size = data_size;
+    sync_command_rw.data_size = 4;
+    sync_command_rw.data.u16[0] = size;
+    sync_command_rw.data.u16[1] = slot;
+    sync_command_rw.data.u32[1] = offset;
+
+    if (dfu_send_to_crypto(&sync_command_rw) != SYS_E_DONE) {
+        upload.in_flight = false;
+        if (slot == 0) {
+            /* the host is waiting for this block */
+            dfu_leave_session_with_error(ERRUNKNOWN);
+        } else {
+            dfu_upload_release();
+        }
+    }
+}
+
+/* hand the block at upload.offset to libdfu, and read the next one ahead */
+static void dfu_upload_deliver(const uint8_t *src, uint16_t len)
+{
+    uint16_t size = upload.host_size;
+
+    if (src != upload.host_buf) {
+        memcpy(upload.host_buf, src, len);
+        dfu_upload_release();
+    }
+    upload.host_buf = NULL;
+    perf_load_finished();
+    if (len < size) {
+        /* short frame: end of upload, the next one restarts at offset 0 */
+        upload.offset = 0;
+        dfu_load_finished(len);
+        perf_dump();
+        return;
+    }
+    upload.offset += len;
+    dfu_load_finished(len);
+#if DMASHM_RING_SLOTS
+    /* not before the dropped reads are acknowledged: the read ahead slot
+     * is then released by the oldest acknowledge */
+    if (!upload.in_flight && upload.stale_acks == 0 && dmashm_ring_count() == 0 &&
+        dmashm_ring_push(&upload.prefetch_slot) == 0) {
+        dfu_upload_request(upload.offset, size, upload.prefetch_slot);
+    }
+#endif
+}
+
+/* read request acknowledged by dfucrypto */
+void dfu_handler_load_ack(uint16_t bytes_read)
+{
+    /* read requests are acknowledged in order */
+    if (upload.stale_acks) {
+        upload.stale_acks--;
+        /* a read ahead is only sent without dropped reads pending: its
+         * slot, if still taken, is the one of this acknowledge */
+        if (!upload.in_flight || upload.req_slot != upload.prefetch_slot) {
+            dfu_upload_release();
+        }
+        return;
+    }
+    if (!upload.in_flight) {
+        return;
+    }
+    upload.in_flight = false;
+    if (bytes_read > upload.req_size) {
+        bytes_read = upload.req_size;
+    }
+    if (upload.req_slot != 0) {
+        upload.prefetched = true;
+        upload.prefetch_len = bytes_read;
+    }
+    if (upload.host_buf == NULL) {
+        /* prefetched block, waiting for the host */
+        return;
+    }
+    upload.prefetched = false;
+    dfu_upload_deliver(dmashm_get_slot(upload.req_slot), bytes_read);
+}
+
+/* next upload block, in blocks of the DFU transfer size in use */
+void dfu_handler_set_upload_offset(uint16_t block)
+{
+    dfu_upload_drop();
+    upload.offset = (uint32_t)block << xfer.shift;
+}
 
-    sys_ipc(IPC_SEND_SYNC, get_dfucrypto_id(), sizeof(struct sync_command_data), (char*)&sync_command_rw);
+uint8_t dfu_backend_read(uint8_t *data, uint16_t data_size)
+{
+    TRACE_DBG(TRACE_EV_READ, upload.offset, data_size);
+    perf_load_requested();
+    upload.host_buf = data;
+    upload.host_size = data_size;
 
+    if (upload.prefetched) {
+        upload.prefetched = false;
+        if (upload.req_size == data_size) {
+            dfu_upload_deliver(dmashm_get_slot(upload.prefetch_slot), upload.prefetch_len);
+            return 0;
+        }
+        dfu_upload_release();
+    }
+    if (upload.in_flight) {
+        if (upload.req_offset == upload.offset && upload.req_size == data_size) {
+            /* the block is being read ahead, delivered on its acknowledge */
+            return 0;
+        }
+        dfu_upload_drop();
+    }
+    /* reading the block directly into the libdfu buffer */
+    dfu_upload_request(upload.offset, data_size, 0);
 
     return 0;
 }
 
 void dfu_backend_eof(void)
 {
-    struct sync_command sync_command;
+    struct sync_command_data sync_command = { 0 };
 
     /* Sanity check on the current state ... */
     if(get_task_state() != DFUUSB_STATE_DWNLOAD){
-#if DFU_USB_DEBUG
-       printf("Error: dfu_backend_eof while not in DFUUSB_STATE_DWNLOAD \n");
-#endif
+       TRACE_ERR(TRACE_EV_EOF, get_task_state(), 0);
        return;
     }
 
 
-#if DFU_USB_DEBUG
-    printf("sendinf EOF to flash\n");
+    TRACE_DBG(TRACE_EV_EOF, get_task_state(), 0);
+
+#if COALESCE
+    /* a short last block has already been flushed */
+    dfu_span_flush();
 #endif
 
+    digest_final();
+
     sync_command.magic = MAGIC_DFU_DWNLOAD_FINISHED;
     sync_command.state = SYNC_DONE;
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+    if (images_following) {
+        /* commit this image, dfucrypto waits for the next one */
+        sync_command.state = SYNC_WAIT;
+    }
+#endif
 // fixme no field for DFU... ?    sync_command_rw.sector_size = data_size;
 
-    sys_ipc(IPC_SEND_SYNC, get_dfucrypto_id(), sizeof(struct sync_command), (char*)&sync_command);
+    dfuusb_send_ipc(&sync_command, sizeof(struct sync_command), 0);
+
+    perf_dump();
+
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+    if (images_following) {
+        /* header, authentication and download state are reset by the
+         * block 0 of the next image, once its target is selected */
+        target_required = true;
+        set_task_state(DFUUSB_STATE_IDLE);
+    }
+#endif
 
     return;
 }
+
+#if CONFIG_APP_DFUUSB_BG_ERASE
+/*
+ * Header validated: dfucrypto erases the whole image range in background,
+ * instead of erasing each sector when the first store request reaches it.
+ * Best effort: if not sent, the sectors are erased by the store requests.
+ */
+void dfu_handler_erase_request(void)
+{
+    struct sync_command_data sync_command;
+
+    memset((void*)&sync_command, 0, sizeof(sync_command));
+    sync_command.magic = MAGIC_DFU_ERASE;
+    sync_command.state = SYNC_ASK_FOR_DATA;
+    sync_command.data_size = DFUUSB_IPC_WORDS(4);
+    sync_command.data.u32[0] = parsed_header.hdr.len;
+    if (dfu_send_to_crypto(&sync_command) != SYS_E_DONE) {
+        TRACE_ERR(TRACE_EV_ERASE_ERR, 0, SYNC_ASK_FOR_DATA);
+        return;
+    }
+    TRACE_INFO(TRACE_EV_ERASE, parsed_header.hdr.len, 0);
+}
+
+void dfu_handler_erase_progress(uint8_t state, uint32_t erased)
+{
+    switch (state) {
+        case SYNC_WAIT:
+            /* in progress */
+            break;
+        case SYNC_DONE:
+            TRACE_INFO(TRACE_EV_ERASE_DONE, erased, 0);
+            break;
+        default:
+            /* the image can't be written */
+            TRACE_ERR(TRACE_EV_ERASE_ERR, erased, state);
+            if (get_task_state() == DFUUSB_STATE_DWNLOAD) {
+                dfu_leave_session_with_error(ERRERASE);
+                set_task_state(DFUUSB_STATE_IDLE);
+            }
+            break;
+    }
+}
+#endif
+
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+/* may be called from ISR context, to refuse the vendor request */
+int dfu_handler_check_target(uint16_t target, uint16_t following)
+{
+    /* no target change in the middle of an image */
+    if (get_task_state() != DFUUSB_STATE_IDLE ||
+        target >= CONFIG_APP_DFUUSB_MAX_IMAGES ||
+        following >= CONFIG_APP_DFUUSB_MAX_IMAGES) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The target is only recorded here, dfucrypto being informed on the next
+ * block 0. If it is refused at this point (the state changed since the
+ * vendor request was accepted), the next image is refused too, rather
+ * than being written to the previous target.
+ */
+int dfu_handler_set_target(uint16_t target, uint16_t following)
+{
+    if (dfu_handler_check_target(target, following)) {
+        TRACE_ERR(TRACE_EV_TARGET_ERR, target, following);
+        target_required = true;
+        return -1;
+    }
+    next_target = target;
+    images_following = following;
+    target_required = false;
+    target_changed = true;
+    return 0;
+}
+
+/*
+ * The host did not send the next image within the timeout after the
+ * manifestation of the previous one: rebooting, as if it was the last.
+ */
+void dfu_handler_check_deferred_reset(void)
+{
+    uint64_t now = 0;
+
+    if (!reset_deferred) {
+        return;
+    }
+    sys_get_systick(&now, PREC_MILLI);
+    if (now - reset_deferred_ts >= CONFIG_APP_DFUUSB_MULTI_IMAGE_TIMEOUT) {
+        TRACE_ERR(TRACE_EV_TARGET_TIMEOUT, next_target, images_following);
+        reset_deferred = false;
+        images_following = 0;
+        dfu_reset_asked = true;
+    }
+}
+
+/* inform dfucrypto of the target image selected by the host, if any */
+static int dfu_send_target(void)
+{
+    struct sync_command_data sync_command;
+
+    if (!target_changed) {
+        return 0;
+    }
+    target_changed = false;
+    memset((void*)&sync_command, 0, sizeof(sync_command));
+    sync_command.magic = MAGIC_DFU_TARGET;
+    sync_command.state = SYNC_READY;
+    sync_command.data_size = DFUUSB_IPC_WORDS(2);
+    sync_command.data.u8[0] = next_target;
+    sync_command.data.u8[1] = images_following;
+    if (dfu_send_to_crypto(&sync_command) != SYS_E_DONE) {
+        return -1;
+    }
+    TRACE_INFO(TRACE_EV_TARGET, next_target, images_following);
+    return 0;
+}
+#endif
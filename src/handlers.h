@@ -26,8 +26,87 @@
 #define DFUUSB_HANDLERS_H_
 
 #include "libc/types.h"
+#include "dmashm.h"
 
-uint8_t dfu_handler_post_auth(void);
+/*
+ * DFU transfer size: at most a DMA SHM slot. It is the slot size unless
+ * negotiated against the image crypto chunk size.
+ */
+#define DFU_XFER_SIZE_MAX  DMASHM_SLOT_SIZE
+
+#define DFU_HEADER_LEN     CONFIG_APP_DFUUSB_HEADER_LEN
+#define DFU_MAX_CHUNK_LEN  CONFIG_APP_DFUUSB_MAX_CHUNK_LEN
+
+_Static_assert((DFU_XFER_SIZE_MAX & (DFU_XFER_SIZE_MAX - 1)) == 0, "DFU transfer size must be a power of two");
+/* the header is received in the first DFU block */
+_Static_assert(DFU_HEADER_LEN <= DFU_XFER_SIZE_MAX, "DFU header must fit in a DFU transfer");
+_Static_assert((DFU_HEADER_LEN % 4) == 0, "DFU header length must be word aligned");
+_Static_assert(DFU_MAX_CHUNK_LEN >= DFU_XFER_SIZE_MAX, "crypto chunks can't be smaller than a DFU transfer");
+
+uint16_t dfu_handler_get_xfer_size(void);
+
+/* transfer sizes, as reported to the host by the GET_XFER_SIZE request */
+typedef struct __attribute__((packed)) {
+    uint16_t wsize;         /* DFU functional descriptor wTransferSize */
+    uint16_t size;          /* transfer size of the current session */
+    uint16_t negotiated;    /* size to restart with, 0 if none */
+} t_dfu_xfer_info;
+
+void dfu_handler_get_xfer_info(t_dfu_xfer_info *info);
+
+int dfu_handler_set_crypto_chunk_size(uint16_t crypto_sz);
+
+void dfu_handler_usb_reset(void);
+
+void dfu_handler_load_ack(uint16_t bytes_read);
+
+void dfu_handler_set_upload_offset(uint16_t block);
+
+#if CONFIG_APP_DFUUSB_RESUME
+/* download resume record, as reported to the host */
+typedef struct __attribute__((packed)) {
+    uint8_t  state;            /* current t_dfuusb_state */
+    uint8_t  resumable;        /* 1 if the download can be resumed */
+    uint16_t resume_block;     /* first DFU block of the first uncommitted crypto chunk */
+    uint16_t committed_chunks; /* crypto chunks stored by dfucrypto, header chunk included */
+    uint16_t xfer_size;        /* DFU transfer size */
+    uint32_t committed_bytes;
+} t_dfu_resume_info;
+
+void dfu_handler_get_resume_info(t_dfu_resume_info *info);
+#endif
+
+void dfu_handler_auth_end(bool valid);
+
+#if CONFIG_APP_DFUUSB_CHUNK_RETRY
+/* failed crypto chunk record, as reported to the host */
+typedef struct __attribute__((packed)) {
+    uint8_t  state;            /* current t_dfuusb_state */
+    uint8_t  reason;           /* t_trace_sanity of the refused block */
+    uint16_t failed_chunk;     /* crypto chunk to send again */
+    uint16_t restart_block;    /* first DFU block of the failed crypto chunk */
+    uint16_t xfer_size;        /* DFU transfer size */
+} t_dfu_recovery_info;
+
+void dfu_handler_get_recovery_info(t_dfu_recovery_info *info);
+#endif
+
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+/* select the target image of the next download, return -1 if refused */
+int dfu_handler_check_target(uint16_t target, uint16_t images_following);
+
+int dfu_handler_set_target(uint16_t target, uint16_t images_following);
+
+void dfu_handler_check_deferred_reset(void);
+#endif
+
+void dfu_handler_store_ack(uint8_t slot);
+
+#if CONFIG_APP_DFUUSB_BG_ERASE
+void dfu_handler_erase_request(void);
+
+void dfu_handler_erase_progress(uint8_t state, uint32_t erased);
+#endif
 
 static inline int dfu_crypto_chunk_size_sanity_check(uint16_t dfu_sz, uint16_t crypto_sz){
         if((dfu_sz == 0) || (crypto_sz == 0)){
@@ -0,0 +1,122 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_IPC_EXT_H_
+#define DFUUSB_IPC_EXT_H_
+
+#include "wookey_ipc.h"
+
+/*
+ * dfuusb <-> dfucrypto protocol extensions, not (yet) part of
+ * wookey_ipc.h. dfucrypto must be built with the same values.
+ */
+
+/*
+ * data_size unit: in both directions, data_size is the payload length in
+ * 16-bit words, the payload being padded to an even length. This is the
+ * legacy unit of MAGIC_DATA_WR_DMA_REQ, MAGIC_DATA_RD_DMA_REQ and of the
+ * acknowledges, used by all the extensions below. The only exception is
+ * the legacy MAGIC_DFU_HEADER_SEND, whose data_size is the length in bytes
+ * of the header fragment.
+ */
+#define DFUUSB_IPC_WORDS(bytes) (((bytes) + 1) / 2)
+#define DFUUSB_IPC_BYTES(words) ((words) * 2)
+
+/*
+ * DFU header descriptor: the header is in the DMA SHM (data_size 4)
+ * data.u16[0]: header offset in the DMA SHM
+ * data.u16[1]: header length
+ * data.u32[1]: header CRC32
+ */
+#define MAGIC_DFU_HEADER_SHM    0xd0
+
+/*
+ * IPC framing, negotiated at the acknowledged startup synchronization
+ * (APP_DFUUSB_SYNC_ACK, version 0 being used otherwise): dfuusb sends
+ * its version in data.u8[8] of the RESP/SYNC_READY message (after the DMA
+ * SHM description, data_size 5), and dfucrypto answers with its own one
+ * in data.u8[0] of its acknowledge (data_size 1). The lowest one is used.
+ * A peer not sending any version is considered as using version 0.
+ *
+ * version 0: legacy framing, each message is sent as a whole struct
+ *            sync_command or struct sync_command_data.
+ * version 1: the message header (magic, state, data_size) is followed by
+ *            the protocol version, then by the used payload bytes only:
+ *            the IPC size is the payload length plus the header size.
+ *            Header fragments (MAGIC_DFU_HEADER_SEND) use the whole IPC
+ *            message size.
+ */
+#define DFUUSB_IPC_VERSION      1
+
+/* EwoK kernel IPC message size limit */
+#define DFUUSB_IPC_MSG_MAX      128
+#define DFUUSB_IPC_HDR_SIZE     4
+#define DFUUSB_IPC_PAYLOAD_MAX  (DFUUSB_IPC_MSG_MAX - DFUUSB_IPC_HDR_SIZE)
+
+/* version 1 message, a superset of struct sync_command_data */
+typedef struct {
+    uint8_t magic;
+    uint8_t state;
+    uint8_t data_size;
+    uint8_t version;
+    union {
+        uint8_t  u8[DFUUSB_IPC_PAYLOAD_MAX];
+        uint16_t u16[DFUUSB_IPC_PAYLOAD_MAX / 2];
+        uint32_t u32[DFUUSB_IPC_PAYLOAD_MAX / 4];
+    } data;
+} t_dfuusb_ipc_msg;
+
+_Static_assert(__builtin_offsetof(struct sync_command_data, data) == DFUUSB_IPC_HDR_SIZE,
+               "unexpected struct sync_command_data layout");
+_Static_assert(__builtin_offsetof(t_dfuusb_ipc_msg, data) == DFUUSB_IPC_HDR_SIZE,
+               "unexpected IPC header size");
+
+/*
+ * MAGIC_DATA_WR_DMA_REQ with a DMA SHM ring (data_size 3):
+ * data.u16[0]: size, which may span several contiguous slots
+ * data.u16[1]: first block number, past the header crypto chunk
+ * data.u16[2]: first slot, returned in data.u16[0] of the acknowledge
+ */
+
+/*
+ * Target image of the next download (multi-image sessions, data_size 1)
+ * data.u8[0]: target image index
+ * data.u8[1]: number of images following this one in the session
+ * A MAGIC_DFU_DWNLOAD_FINISHED with state SYNC_WAIT commits the image
+ * without rebooting, SYNC_DONE terminates the session.
+ */
+#define MAGIC_DFU_TARGET        0xd1
+
+/*
+ * Background erase of the target range, sent once the header is validated
+ * and before any store request (data_size 2):
+ * data.u32[0]: length of the image data to be stored
+ * dfucrypto answers with the same magic (data_size 2), data.u32[0] being the number of
+ * bytes erased from the start of the range: state SYNC_WAIT while erasing,
+ * SYNC_DONE once the whole range is erased, SYNC_FAILURE on error. Store
+ * requests beyond the erase front wait for it.
+ */
+#define MAGIC_DFU_ERASE         0xd2
+
+#endif/*!DFUUSB_IPC_EXT_H_*/
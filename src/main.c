@@ -34,51 +34,71 @@
 #include "libc/nostd.h"
 #include "libc/string.h"
 #include "wookey_ipc.h"
+#include "ipc_ext.h"
 #include "libusbctrl.h"
 #include "dfu.h"
 #include "handlers.h"
+#include "dmashm.h"
+#include "vendor.h"
+#include "trace.h"
+#include "stack.h"
+#include "stats.h"
+#include "event.h"
 #include "main.h"
+#if !CONFIG_APP_DFUUSB_MIN_RAM
 #include "libc/malloc.h"
+#endif
 #include "generated/devlist.h"
 
 
-#define USB_BUF_SIZE 4096
-#define DFU_USB_DEBUG 1
 
 extern volatile bool dfu_reset_asked;
 
-/* libusbctrl specific triggers and contexts */
-
-volatile bool reset_requested = false;
+/* libusbctrl specific triggers and contexts, executed in ISR context */
 
 uint32_t usbxdci_handler;
 
 void usbctrl_reset_received(void) {
-    reset_requested = true;
+    dfuusb_event_push(DFUUSB_EV_RESET, 0);
 }
 
-static volatile bool conf_set = false;
-
 void usbctrl_configuration_set(void)
 {
-    conf_set = true;
+    dfuusb_event_push(DFUUSB_EV_SET_CONFIG, 0);
 }
 
+/* USB state, as seen by the main thread */
+static bool reset_requested = false;
+static bool conf_set = false;
+
 
 /**/
 
 
+static void dfuusb_wait_event(void);
+
 static void main_thread_dfu_reset_device(void)
 {
     e_syscall_ret ret;
 
     dfu_reset_asked = false;
 
-    struct sync_command ipc_sync_cmd;
-    memset((void*)&ipc_sync_cmd, 0, sizeof(struct sync_command));
+#if DMASHM_RING_SLOTS
+    /* the last stores may still be in flight: dfucrypto handles the reboot
+     * request once it has sent their acknowledges, which must then be
+     * received before freezing */
+    while (dmashm_ring_count() || dfuusb_ipc_deferred()) {
+        if (!dfuusb_poll_ipc()) {
+            dfuusb_wait_event();
+        }
+    }
+#endif
+
+    struct sync_command_data ipc_sync_cmd;
+    memset((void*)&ipc_sync_cmd, 0, sizeof(struct sync_command_data));
 
     ipc_sync_cmd.magic = MAGIC_REBOOT_REQUEST;
-    ret = sys_ipc(IPC_SEND_SYNC, get_dfucrypto_id(), sizeof(struct sync_command), (char*)&ipc_sync_cmd);
+    ret = dfuusb_send_ipc(&ipc_sync_cmd, sizeof(struct sync_command), 0);
     if (ret != SYS_E_DONE) {
 # if USB_APP_DEBUG
         printf("%s:%d Oops ! ret = %d\n", __func__, __LINE__, ret);
@@ -93,23 +113,352 @@ static void main_thread_dfu_reset_device(void)
 }
 
 
-/* NOTE: alignment due to DMA */
-__attribute__((aligned(4))) static uint8_t usb_buf[USB_BUF_SIZE] = { 0 };
-
-
 static uint8_t id_dfucrypto = 0;
 
-/* DFU and crypto chunk sizes.
+/* Crypto chunk size.
  * We must have sizeof(crypto_chunk) = multiple of sizeof(DFU_chunk).
  */
 volatile uint16_t crypto_chunk_size = 0;
-volatile uint16_t dfu_usb_chunk_size = 0;
 
 uint8_t get_dfucrypto_id(void)
 {
     return id_dfucrypto;
 }
 
+/* IPC framing version in use with dfucrypto, set at startup */
+static uint8_t ipc_version = 0;
+
+uint8_t dfuusb_ipc_version(void)
+{
+    return ipc_version;
+}
+
+/*
+ * Send a message to dfucrypto. msg starts with a struct sync_command_data
+ * header, followed by payload_len used bytes. With the legacy framing,
+ * legacy_size bytes are sent.
+ * When store requests are in flight, dfucrypto may be sending us an
+ * acknowledge at the same time. The kernel then refuses the send, and the
+ * pending acknowledge is received first, to be handled later by the main
+ * loop.
+ */
+e_syscall_ret dfuusb_send_ipc(void *msg, logsize_t legacy_size, uint8_t payload_len)
+{
+    logsize_t size = legacy_size;
+    e_syscall_ret ret;
+
+    if (ipc_version >= 1) {
+        ((uint8_t*)msg)[DFUUSB_IPC_HDR_SIZE - 1] = ipc_version;
+        size = DFUUSB_IPC_HDR_SIZE + payload_len;
+    }
+    do {
+        ret = sys_ipc(IPC_SEND_SYNC, id_dfucrypto, size, (const char*)msg);
+    } while (ret == SYS_E_BUSY && dfuusb_defer_ipc() == 0);
+    if (ret == SYS_E_DONE) {
+        stats_ipc_sent();
+    }
+    return ret;
+}
+
+/* handle an IPC received from dfucrypto */
+static void dfuusb_handle_ipc(struct sync_command_data *sync_command_ack)
+{
+    switch (sync_command_ack->magic) {
+        case MAGIC_DATA_WR_DMA_ACK:
+            {
+                /* with a single slot, there is no slot index in the ack */
+                dfu_handler_store_ack(DMASHM_RING_SLOTS ? sync_command_ack->data.u16[0] : 0);
+                break;
+            }
+        case MAGIC_DATA_RD_DMA_ACK:
+            {
+                uint16_t bytes_read = sync_command_ack->data.u16[0];
+                dfu_handler_load_ack(bytes_read);
+                break;
+            }
+        case MAGIC_DFU_HEADER_VALID:
+            {
+                if (get_task_state() != DFUUSB_STATE_AUTH) {
+                    /* no authentication in progress (e.g. restarted meanwhile) */
+                    TRACE_INFO(TRACE_EV_IPC_STALE, sync_command_ack->magic, get_task_state());
+                    break;
+                }
+                set_task_state(DFUUSB_STATE_DWNLOAD);
+                stats_wait_end();
+                /* Get the crypto header length here */
+                if(sync_command_ack->data_size != 1){
+                    /* Wrong size */
+                    TRACE_ERR(TRACE_EV_HEADER_VALID_ERR, sync_command_ack->data_size, 0);
+                    dfu_handler_auth_end(false);
+                    dfu_leave_session_with_error(ERRFILE);
+                    set_task_state(DFUUSB_STATE_IDLE);
+                }
+                else{
+                    crypto_chunk_size = sync_command_ack->data.u16[0];
+                    TRACE_INFO(TRACE_EV_HEADER_VALID, crypto_chunk_size, 0);
+                    /* Sanity check */
+                    if(dfu_handler_set_crypto_chunk_size(crypto_chunk_size)){
+                        TRACE_ERR(TRACE_EV_CHUNK_SIZE_ERR, crypto_chunk_size, dfu_handler_get_xfer_size());
+                        /* the host may restart with the negotiated transfer size, if any */
+                        dfu_handler_auth_end(false);
+                        dfu_leave_session_with_error(ERRFILE);
+                        set_task_state(DFUUSB_STATE_IDLE);
+                    } else {
+#if CONFIG_APP_DFUUSB_BG_ERASE
+                        /* before the store requests of the buffered blocks */
+                        dfu_handler_erase_request();
+#endif
+                        /* ends the DNLOAD request of the last header chunk block */
+                        dfu_handler_auth_end(true);
+                    }
+                }
+                break;
+            }
+#if CONFIG_APP_DFUUSB_BG_ERASE
+        case MAGIC_DFU_ERASE:
+            {
+                dfu_handler_erase_progress(sync_command_ack->state, sync_command_ack->data.u32[0]);
+                break;
+            }
+#endif
+        case MAGIC_DFU_HEADER_INVALID:
+            {
+                if (get_task_state() != DFUUSB_STATE_AUTH) {
+                    /* verdict of an abandoned authentication */
+                    TRACE_INFO(TRACE_EV_IPC_STALE, sync_command_ack->magic, get_task_state());
+                    break;
+                }
+                /* error !*/
+                TRACE_ERR(TRACE_EV_HEADER_INVALID, sync_command_ack->state, 0);
+                stats_wait_end();
+                if (sync_command_ack->state == SYNC_BADFILE) {
+                    dfu_handler_auth_end(false);
+                    dfu_leave_session_with_error(ERRFILE);
+                    set_task_state(DFUUSB_STATE_IDLE);
+                } else {
+                    dfu_handler_auth_end(false);
+                    dfu_leave_session_with_error(ERRFILE);
+                    set_task_state(DFUUSB_STATE_IDLE);
+                }
+                break;
+            }
+        default:
+            {
+                /* dropped: the download in progress is not affected */
+                TRACE_ERR(TRACE_EV_IPC_UNKNOWN, sync_command_ack->magic, 0);
+                break;
+            }
+    }
+}
+
+/*
+ * Wait for the next event: an IPC from dfucrypto or a USB interrupt, both
+ * awaking the interruptible sleep. The timeout only bounds the wait when
+ * the event is raised between the last check and the sleep request.
+ */
+static void dfuusb_wait_event(void)
+{
+    sys_sleep(CONFIG_APP_DFUUSB_EVENT_TIMEOUT, SLEEP_MODE_INTERRUPTIBLE);
+}
+
+/*
+ * Handle the pending USB events, in order. A reset stops the handling,
+ * the following events being handled once the DFU stack is reinitialized.
+ * Return true if an event has been handled.
+ */
+static bool dfuusb_handle_events(void)
+{
+    static uint32_t drops = 0;
+    t_dfuusb_event ev;
+    bool handled = false;
+
+    if (dfuusb_event_dropped() != drops) {
+        drops = dfuusb_event_dropped();
+        TRACE_ERR(TRACE_EV_USB_EV_DROPPED, drops, 0);
+    }
+    while (!reset_requested && dfuusb_event_pop(&ev) == 0) {
+        handled = true;
+        switch (ev.type) {
+            case DFUUSB_EV_RESET:
+                reset_requested = true;
+                /* the host enumerates the device again */
+                conf_set = false;
+                break;
+            case DFUUSB_EV_SET_CONFIG:
+                conf_set = true;
+                break;
+#if CONFIG_APP_DFUUSB_VENDOR_RQST
+            case DFUUSB_EV_UPLOAD_OFFSET:
+                dfu_handler_set_upload_offset(ev.arg);
+                break;
+#endif
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+            case DFUUSB_EV_TARGET:
+                dfu_handler_set_target(ev.arg & 0xff, (ev.arg >> 8) & 0xff);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+    return handled;
+}
+
+/*
+ * IPCs received while dfucrypto was refusing a send, because it was
+ * sending to us at the same time. They are handled in order by the main
+ * loop, and not from within the sender, whose state may be half updated.
+ * dfucrypto has at most one acknowledge per request in flight: a store
+ * per DMA SHM slot, an upload read and a header or erase report (erase
+ * progress reports being merged).
+ */
+#define IPC_DEFERRED_MAX (DMASHM_SLOTS + 2)
+
+static struct {
+    uint8_t head;
+    uint8_t count;
+    struct sync_command_data msg[IPC_DEFERRED_MAX];
+} ipc_deferred = { 0 };
+
+static bool dfuusb_recv_ipc(struct sync_command_data *msg)
+{
+    uint8_t id = id_dfucrypto;
+    logsize_t size = sizeof(struct sync_command_data);
+
+    if (sys_ipc(IPC_RECV_ASYNC, &id, &size, (char*)msg) != SYS_E_DONE) {
+        return false;
+    }
+    stats_ipc_received();
+    return true;
+}
+
+/*
+ * Receive the pending IPC from dfucrypto, if any, without handling it.
+ * Return -1 if there is no room left to keep it.
+ */
+int dfuusb_defer_ipc(void)
+{
+    struct sync_command_data msg;
+#if CONFIG_APP_DFUUSB_BG_ERASE
+    struct sync_command_data *tail = NULL;
+
+    if (ipc_deferred.count) {
+        tail = &ipc_deferred.msg[(ipc_deferred.head + ipc_deferred.count - 1) % IPC_DEFERRED_MAX];
+    }
+    /* an erase progress report supersedes the previous one */
+    if (tail && tail->magic == MAGIC_DFU_ERASE && tail->state == SYNC_WAIT) {
+        if (!dfuusb_recv_ipc(&msg)) {
+            return 0;
+        }
+        if (msg.magic == MAGIC_DFU_ERASE && msg.state == SYNC_WAIT) {
+            *tail = msg;
+            return 0;
+        }
+        goto queue;
+    }
+#endif
+    if (ipc_deferred.count >= IPC_DEFERRED_MAX) {
+        TRACE_ERR(TRACE_EV_IPC_OVERFLOW, ipc_deferred.count, 0);
+        return -1;
+    }
+    if (!dfuusb_recv_ipc(&msg)) {
+        return 0;
+    }
+#if CONFIG_APP_DFUUSB_BG_ERASE
+queue:
+    if (ipc_deferred.count >= IPC_DEFERRED_MAX) {
+        /* received, but no room left: dropped */
+        TRACE_ERR(TRACE_EV_IPC_OVERFLOW, ipc_deferred.count, msg.magic);
+        return -1;
+    }
+#endif
+    ipc_deferred.msg[(ipc_deferred.head + ipc_deferred.count) % IPC_DEFERRED_MAX] = msg;
+    ipc_deferred.count++;
+    return 0;
+}
+
+bool dfuusb_ipc_deferred(void)
+{
+    return ipc_deferred.count != 0;
+}
+
+/*
+ * Handle at most one pending IPC from dfucrypto, without blocking, the
+ * deferred ones first. Return true if an IPC has been handled.
+ */
+bool dfuusb_poll_ipc(void)
+{
+    struct sync_command_data sync_command_ack = { 0 };
+
+    if (ipc_deferred.count) {
+        sync_command_ack = ipc_deferred.msg[ipc_deferred.head];
+        ipc_deferred.head = (ipc_deferred.head + 1) % IPC_DEFERRED_MAX;
+        ipc_deferred.count--;
+    } else if (!dfuusb_recv_ipc(&sync_command_ack)) {
+        return false;
+    }
+    dfuusb_handle_ipc(&sync_command_ack);
+    return true;
+}
+
+/*
+ * Startup handshake with dfucrypto. Each step is acknowledged by the peer,
+ * so that no fixed delay is required before starting the USB device.
+ */
+static void dfuusb_sync_send(const void *msg, logsize_t size)
+{
+    e_syscall_ret ret;
+
+    while ((ret = sys_ipc(IPC_SEND_SYNC, id_dfucrypto, size, (const char*)msg)) != SYS_E_DONE) {
+        printf("sync with dfucrypto: Oops ! ret = %d\n", ret);
+        sys_yield();
+    }
+}
+
+/* block until dfucrypto sends the expected magic and state, returned in msg */
+static void dfuusb_sync_wait(uint8_t magic, uint8_t state, struct sync_command_data *ack)
+{
+    struct sync_command_data msg;
+    logsize_t size;
+    uint8_t id;
+
+    do {
+        id = id_dfucrypto;
+        size = sizeof(struct sync_command_data);
+        memset((void*)&msg, 0, sizeof(msg));
+        if (sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&msg) != SYS_E_DONE) {
+            continue;
+        }
+        if (msg.magic != magic || msg.state != state) {
+            printf("sync with dfucrypto: unexpected %x:%x\n", msg.magic, msg.state);
+        }
+    } while (msg.magic != magic || msg.state != state);
+    if (ack != NULL) {
+        memcpy((void*)ack, (void*)&msg, sizeof(msg));
+    }
+}
+
+/* boot to enumeration time, in get_timestamp() units */
+static uint64_t boot_ts;
+
+#if CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES >= 3
+# define TS_UNIT "cycles"
+#elif CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES >= 2
+# define TS_UNIT "us"
+#else
+# define TS_UNIT "ms"
+#endif
+
+static inline void dfuusb_boot_time(const char *step)
+{
+#if CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES
+    printf("boot: %s after %d %s\n", step,
+           (uint32_t)(get_timestamp() - boot_ts), TS_UNIT);
+#else
+    (void)step;
+#endif
+}
+
 /*
  * We use the local -fno-stack-protector flag for main because
  * the stack protection has not been initialized yet.
@@ -117,13 +466,18 @@ uint8_t get_dfucrypto_id(void)
 int _main(uint32_t task_id)
 {
     volatile e_syscall_ret ret = 0;
-    uint8_t id;
+    mbed_error_t errcode;
 
     struct sync_command      ipc_sync_cmd;
+#if CONFIG_APP_DFUUSB_SYNC_ACK
+    struct sync_command_data ipc_sync_ready = { 0 };
+#endif
 
     dma_shm_t dmashm_rd;
     dma_shm_t dmashm_wr;
 
+    boot_ts = get_timestamp();
+    stack_paint();
     printf("Hello ! I'm usb, my id is %x\n", task_id);
 
     ret = sys_init(INIT_GETTASKID, "dfucrypto", &id_dfucrypto);
@@ -131,16 +485,23 @@ int _main(uint32_t task_id)
 
     /* initialize USB Control plane */
 #if CONFIG_APP_DFUUSB_USR_DRV_USB_HS
-    usbctrl_declare(USB_OTG_HS_ID, &usbxdci_handler);
+    errcode = usbctrl_declare(USB_OTG_HS_ID, &usbxdci_handler);
 #elif CONFIG_APP_DFUUSB_USR_DRV_USB_FS
-    usbctrl_declare(USB_OTG_FS_ID, &usbxdci_handler);
+    errcode = usbctrl_declare(USB_OTG_FS_ID, &usbxdci_handler);
 #else
 # error "Unsupported USB driver backend"
 #endif
+    if (errcode != MBED_ERROR_NONE) {
+        printf("USB device declaration failed: %d\n", errcode);
+        return 1;
+    }
     usbctrl_initialize(usbxdci_handler);
 
     /* early init DFU stack */
     dfu_declare(usbxdci_handler);
+#if CONFIG_APP_DFUUSB_VENDOR_RQST
+    dfuusb_vendor_declare(usbxdci_handler);
+#endif
 
 
     /*********************************************
@@ -148,15 +509,15 @@ int _main(uint32_t task_id)
      *********************************************/
     dmashm_rd.target = id_dfucrypto;
     dmashm_rd.source = task_id;
-    dmashm_rd.address = (physaddr_t)usb_buf;
-    dmashm_rd.size = USB_BUF_SIZE;
+    dmashm_rd.address = (physaddr_t)dmashm_get_buf();
+    dmashm_rd.size = DMASHM_SIZE;
     /* Crypto DMA will read from this buffer */
     dmashm_rd.mode = DMA_SHM_ACCESS_RD;
 
     dmashm_wr.target = id_dfucrypto;
     dmashm_wr.source = task_id;
-    dmashm_wr.address = (physaddr_t)usb_buf;
-    dmashm_wr.size = USB_BUF_SIZE;
+    dmashm_wr.address = (physaddr_t)dmashm_get_buf();
+    dmashm_wr.size = DMASHM_SIZE;
     /* Crypto DMA will write into this buffer */
     dmashm_wr.mode = DMA_SHM_ACCESS_WR;
 
@@ -183,100 +544,84 @@ int _main(uint32_t task_id)
     /*******************************************
      * let's syncrhonize with other tasks
      *******************************************/
-    logsize_t size = sizeof (struct sync_command);
 
+    /* end_of_init: acknowledged by dfucrypto */
     printf("sending end_of_init syncrhonization to dfucrypto\n");
     ipc_sync_cmd.magic = MAGIC_TASK_STATE_CMD;
     ipc_sync_cmd.state = SYNC_READY;
+    dfuusb_sync_send(&ipc_sync_cmd, sizeof(struct sync_command));
+    dfuusb_sync_wait(MAGIC_TASK_STATE_RESP, SYNC_ACKNOWLEDGE, NULL);
+    printf("dfucrypto has acknowledge end_of_init, continuing\n");
 
-    do {
-      ret = sys_ipc(IPC_SEND_SYNC, id_dfucrypto, size, (const char*)&ipc_sync_cmd);
-      if (ret != SYS_E_DONE) {
-          printf("Oops ! ret = %d\n", ret);
-      } else {
-          printf("end of end_of_init synchro.\n");
-      }
-    } while (ret != SYS_E_DONE);
-
-    /* Now wait for Acknowledge from Smart */
-    id = id_dfucrypto;
+    /* end_of_cryp: dfucrypto is ready */
+    printf("waiting end_of_cryp syncrhonization from dfucrypto\n");
+    dfuusb_sync_wait(MAGIC_TASK_STATE_CMD, SYNC_READY, NULL);
+    printf("dfucrypto module is ready\n");
 
-    do {
-        ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd);
-      if (ret != SYS_E_DONE) {
-          printf("ack from dfucrypto: Oops ! ret = %d\n", ret);
-      } else {
-          printf("Aclknowledge from dfucrypto ok\n");
-      }
-    } while (ret != SYS_E_DONE);
-    if (   ipc_sync_cmd.magic == MAGIC_TASK_STATE_RESP
-        && ipc_sync_cmd.state == SYNC_ACKNOWLEDGE) {
-        printf("dfucrypto has acknowledge end_of_init, continuing\n");
-    }
+#if !CONFIG_APP_DFUUSB_MIN_RAM
+    /* Initialize USB device */
+    wmalloc_init();
+#endif
 
+#if CONFIG_APP_DFUUSB_SYNC_ACK
     /*******************************************
-     * Starting end_of_cryp synchronization
+     * Sharing DMA SHM address and size with dfucrypto
+     * in the ready response, acknowledged once mapped
      *******************************************/
+    ipc_sync_ready.magic = MAGIC_TASK_STATE_RESP;
+    ipc_sync_ready.state = SYNC_READY;
+    ipc_sync_ready.data_size = DFUUSB_IPC_WORDS(9);
+    ipc_sync_ready.data.u32[0] = (uint32_t)dmashm_get_buf();
+    ipc_sync_ready.data.u16[2] = DMASHM_SIZE;
+    /* slot size, the number of slots being size / slot_size */
+    ipc_sync_ready.data.u16[3] = DMASHM_SLOT_SIZE;
+    /* IPC framing negotiation */
+    ipc_sync_ready.data.u8[8] = DFUUSB_IPC_VERSION;
 
-    printf("waiting end_of_cryp syncrhonization from dfucrypto\n");
-
-    id = id_dfucrypto;
-    size = sizeof(struct sync_command);
-
-    do {
-        ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd);
-    } while (ret != SYS_E_DONE);
-
-    if (   ipc_sync_cmd.magic == MAGIC_TASK_STATE_CMD
-        && ipc_sync_cmd.state == SYNC_READY) {
-        printf("dfucrypto module is ready\n");
+    printf("informing dfucrypto about DMA SHM...\n");
+    dfuusb_sync_send(&ipc_sync_ready, sizeof(struct sync_command_data));
+    dfuusb_sync_wait(MAGIC_TASK_STATE_RESP, SYNC_ACKNOWLEDGE, &ipc_sync_ready);
+    printf("Crypto informed.\n");
+    if (ipc_sync_ready.data_size >= 1) {
+        ipc_version = ipc_sync_ready.data.u8[0];
+        if (ipc_version > DFUUSB_IPC_VERSION) {
+            ipc_version = DFUUSB_IPC_VERSION;
+        }
     }
-
-    /* Initialize USB device */
-    wmalloc_init();
+    printf("IPC framing version %d\n", ipc_version);
+#else
+    /*******************************************
+     * Legacy sequence: ready response, then DMA SHM address and size,
+     * the sends being blocking up to dfucrypto reception. The legacy
+     * IPC framing is used.
+     *******************************************/
     ipc_sync_cmd.magic = MAGIC_TASK_STATE_RESP;
     ipc_sync_cmd.state = SYNC_READY;
+    dfuusb_sync_send(&ipc_sync_cmd, sizeof(struct sync_command));
 
-    size = sizeof(struct sync_command);
-    do {
-      ret = sys_ipc(IPC_SEND_SYNC, id_dfucrypto, size, (char*)&ipc_sync_cmd);
-      if (ret != SYS_E_DONE) {
-          printf("sending Sync ready to dfucrypto: Oops ! ret = %d\n", ret);
-      } else {
-          printf("sending sync ready to dfucrypto ok\n");
-      }
-    } while (ret != SYS_E_DONE);
-
-    // take some time to finish all sync ipc...
-    sys_sleep(1000, SLEEP_MODE_INTERRUPTIBLE);
-
-    /*******************************************
-     * Sharing DMA SHM address and size with dfucrypto
-     *******************************************/
     struct dmashm_info {
         uint32_t addr;
         uint16_t size;
     };
     struct dmashm_info dmashm_info;
 
-    dmashm_info.addr = (uint32_t)usb_buf;
-    dmashm_info.size = USB_BUF_SIZE;
+    dmashm_info.addr = (uint32_t)dmashm_get_buf();
+    dmashm_info.size = DMASHM_SIZE;
 
     printf("informing dfucrypto about DMA SHM...\n");
-    do {
-      ret = sys_ipc(IPC_SEND_SYNC, id_dfucrypto, sizeof(struct dmashm_info), (char*)&dmashm_info);
-    } while (ret != SYS_E_DONE);
+    dfuusb_sync_send(&dmashm_info, sizeof(struct dmashm_info));
     printf("Crypto informed.\n");
+#endif
 
     /*******************************************
      * End of init sequence, let's initialize devices
      *******************************************/
 
-    dfu_usb_chunk_size = USB_BUF_SIZE;
-    dfu_init((uint8_t*)usb_buf, USB_BUF_SIZE);
+    dfu_init(dmashm_get_slot(0), dfu_handler_get_xfer_size());
 
     /* Start USB device */
     usbctrl_start_device(usbxdci_handler);
+    dfuusb_boot_time("USB device started");
 
     /*******************************************
      * Starting USB listener
@@ -284,95 +629,65 @@ int _main(uint32_t task_id)
 
     printf("USB main loop starting\n");
 
-    struct sync_command_data sync_command_ack = { 0 };
-    id = id_dfucrypto;
-    size = sizeof(struct sync_command_data);
-
     /* end of initialization, starting main loop */
     set_task_state(DFUUSB_STATE_IDLE);
 
     do {
         reset_requested = false;
         dfu_reinit();
+        dfu_handler_usb_reset();
+#if CONFIG_APP_DFUUSB_MIN_RAM
+        TRACE_INFO(TRACE_EV_STACK_DEPTH, stack_max_depth(), CONFIG_APP_DFUUSB_STACKSIZE);
+#endif
         /* wait for SetConfiguration */
-        while (!conf_set) {
+        while (!conf_set && !reset_requested) {
+            if (dfuusb_handle_events()) {
+                continue;
+            }
+            trace_drain();
             aprintf_flush();
+            dfuusb_wait_event();
+        }
+        if (reset_requested) {
+            continue;
         }
         printf("Set configuration received\n");
+        if (boot_ts) {
+            dfuusb_boot_time("enumerated");
+            boot_ts = 0;
+        }
         /* detecting end of store (if a previous store request has been
          * executed by the store handler. This is an asyncrhonous end of
          * store management
          */
         while (!reset_requested) {
-            if ((sys_ipc(IPC_RECV_ASYNC, &id, &size, (char*)&sync_command_ack)) == SYS_E_DONE) {
-                switch (sync_command_ack.magic) {
-                    case MAGIC_DATA_WR_DMA_ACK:
-                        {
-                            dfu_store_finished();
-                            break;
-                        }
-                    case MAGIC_DATA_RD_DMA_ACK:
-                        {
-                            uint16_t bytes_read = sync_command_ack.data.u16[0];
-                            dfu_load_finished(bytes_read);
-                            break;
-                        }
-                    case MAGIC_DFU_HEADER_VALID:
-                        {
-                            set_task_state(DFUUSB_STATE_DWNLOAD);
-                            dfu_store_finished();
-                            /* Get the crypto header length here */
-                            if(sync_command_ack.data_size != 1){
-                                /* Wrong size */
-                                printf("Error: error during MAGIC_DFU_HEADER_VALID IPC with dfusmart ...\n");
-                                dfu_leave_session_with_error(ERRFILE);
-                                set_task_state(DFUUSB_STATE_IDLE);
-                            }
-                            else{
-                                crypto_chunk_size = sync_command_ack.data.u16[0];
-#if DFU_USB_DEBUG
-                                printf("Received %d as crypto chunk size from dfusmart!\n", crypto_chunk_size);
-#endif
-                                /* Sanity check */
-                                if(dfu_crypto_chunk_size_sanity_check(dfu_usb_chunk_size, crypto_chunk_size)){
-                                    printf("Error: crypto chunk size %d is not a multiple of DFU chunk size %d\n", crypto_chunk_size, dfu_usb_chunk_size);
-                                    dfu_leave_session_with_error(ERRFILE);
-                                    set_task_state(DFUUSB_STATE_IDLE);
-                                }
-                            }
-                            break;
-                        }
-                    case MAGIC_DFU_HEADER_INVALID:
-                        {
-                            /* error !*/
-                            printf("Error! Invalid header! refusing to continue update\n");
-                            if (sync_command_ack.state == SYNC_BADFILE) {
-                                dfu_store_finished();
-                                dfu_leave_session_with_error(ERRFILE);
-                                set_task_state(DFUUSB_STATE_IDLE);
-                            } else {
-                                dfu_store_finished();
-                                dfu_leave_session_with_error(ERRFILE);
-                                set_task_state(DFUUSB_STATE_IDLE);
-                            }
-                            break;
-                        }
-                    default:
-                        {
-                            printf("Error! unknown IPC magic received: %x\n", sync_command_ack.magic);
-                            set_task_state(DFUUSB_STATE_ERROR);
-                            break;
-                        }
-                }
-            } else {
-                sys_sleep(10, SLEEP_MODE_INTERRUPTIBLE);
+            /* USB events first: a reset aborts the current requests */
+            bool handled = dfuusb_handle_events();
+
+            if (reset_requested) {
+                break;
+            }
+            /* handling all the pending dfucrypto IPCs first, so that store
+             * acknowledges reach libdfu without waiting */
+            while (dfuusb_poll_ipc()) {
+                handled = true;
             }
 
             /* executing the DFU automaton */
             dfu_exec_automaton();
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+            dfu_handler_check_deferred_reset();
+#endif
             if(dfu_reset_asked == true){
                 main_thread_dfu_reset_device();
             }
+            /* nothing to do: sleeping up to the next USB or IPC event. An IPC
+             * sent while the automaton was running has not awoken the task,
+             * hence the last check */
+            if (!handled && !dfuusb_ipc_deferred() && !dfuusb_poll_ipc()) {
+                trace_drain();
+                dfuusb_wait_event();
+            }
         }
     } while (1);
 
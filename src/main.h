@@ -26,9 +26,40 @@
 #define MAIN_H_
 
 #include "libc/types.h"
+#include "libc/syscall.h"
 #include "automaton.h"
 
+/* most accurate timestamp allowed by the task permissions, 0 if none */
+static inline uint64_t get_timestamp(void)
+{
+    uint64_t ts = 0;
+
+#if CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES >= 3
+    sys_get_systick(&ts, PREC_CYCLE);
+#elif CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES >= 2
+    sys_get_systick(&ts, PREC_MICRO);
+#elif CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES >= 1
+    sys_get_systick(&ts, PREC_MILLI);
+#endif
+    return ts;
+}
+
 uint8_t
 get_dfucrypto_id(void);
 
+bool
+dfuusb_poll_ipc(void);
+
+int
+dfuusb_defer_ipc(void);
+
+bool
+dfuusb_ipc_deferred(void);
+
+uint8_t
+dfuusb_ipc_version(void);
+
+e_syscall_ret
+dfuusb_send_ipc(void *msg, logsize_t legacy_size, uint8_t payload_len);
+
 #endif/*!MAIN_H_*/
@@ -0,0 +1,178 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "dmashm.h"
+#include "perf.h"
+
+#if CONFIG_APP_DFUUSB_PERF
+
+static const char *perf_phase_names[PERF_PHASE_NUM] = {
+    "usb",
+    "req",
+    "crypto",
+    "store",
+    "load-usb",
+    "load",
+    "digest"
+};
+
+static t_perf_stats perf_stats[PERF_PHASE_NUM];
+
+/* timestamps of the block being handled by libdfu */
+static uint64_t ts_stored = 0;
+static uint64_t ts_received = 0;
+/* timestamps of the block being uploaded */
+static uint64_t ts_loaded = 0;
+static uint64_t ts_load_requested = 0;
+static uint64_t ts_digest = 0;
+/* store request timestamp, per DMA SHM slot in flight */
+static uint64_t ts_requested[DMASHM_SLOTS];
+
+static inline uint64_t perf_now(void)
+{
+    uint64_t ts = 0;
+
+    sys_get_systick(&ts, PREC_CYCLE);
+    return ts;
+}
+
+static void perf_account(t_perf_phase phase, uint64_t start, uint64_t end)
+{
+    t_perf_stats *stats = &perf_stats[phase];
+    uint32_t delta;
+    uint8_t bucket = 0;
+
+    if (start == 0 || end < start) {
+        return;
+    }
+    delta = (end - start > 0xffffffff) ? 0xffffffff : (uint32_t)(end - start);
+    if (delta != 0) {
+        bucket = 31 - __builtin_clz(delta);
+    }
+    if (stats->count == 0 || delta < stats->min) {
+        stats->min = delta;
+    }
+    if (delta > stats->max) {
+        stats->max = delta;
+    }
+    stats->count++;
+    stats->sum += delta;
+    stats->histo[bucket]++;
+}
+
+void perf_block_received(void)
+{
+    ts_received = perf_now();
+    perf_account(PERF_PHASE_USB, ts_stored, ts_received);
+}
+
+void perf_block_requested(uint8_t slot)
+{
+    uint64_t now = perf_now();
+
+    if (slot < DMASHM_SLOTS) {
+        ts_requested[slot] = now;
+    }
+    perf_account(PERF_PHASE_REQ, ts_received, now);
+}
+
+void perf_block_acked(uint8_t slot)
+{
+    if (slot >= DMASHM_SLOTS) {
+        return;
+    }
+    perf_account(PERF_PHASE_CRYPTO, ts_requested[slot], perf_now());
+    ts_requested[slot] = 0;
+}
+
+void perf_block_stored(void)
+{
+    ts_stored = perf_now();
+    perf_account(PERF_PHASE_STORE, ts_received, ts_stored);
+}
+
+void perf_load_requested(void)
+{
+    ts_load_requested = perf_now();
+    perf_account(PERF_PHASE_LOAD_USB, ts_loaded, ts_load_requested);
+}
+
+void perf_load_finished(void)
+{
+    ts_loaded = perf_now();
+    perf_account(PERF_PHASE_LOAD, ts_load_requested, ts_loaded);
+}
+
+void perf_digest_begin(void)
+{
+    ts_digest = perf_now();
+}
+
+void perf_digest_end(void)
+{
+    perf_account(PERF_PHASE_DIGEST, ts_digest, perf_now());
+}
+
+const t_perf_stats *perf_get_stats(t_perf_phase phase)
+{
+    if (phase >= PERF_PHASE_NUM) {
+        return NULL;
+    }
+    return &perf_stats[phase];
+}
+
+void perf_reset(void)
+{
+    memset(perf_stats, 0, sizeof(perf_stats));
+    memset(ts_requested, 0, sizeof(ts_requested));
+    ts_stored = 0;
+    ts_received = 0;
+    ts_loaded = 0;
+    ts_load_requested = 0;
+}
+
+void perf_dump(void)
+{
+    for (uint8_t i = 0; i < PERF_PHASE_NUM; ++i) {
+        t_perf_stats *stats = &perf_stats[i];
+
+        if (stats->count == 0) {
+            continue;
+        }
+        printf("perf %s: n=%d min=%d max=%d avg=%d cycles\n",
+               perf_phase_names[i], stats->count, stats->min, stats->max,
+               (uint32_t)(stats->sum / stats->count));
+        for (uint8_t j = 0; j < PERF_HISTO_BUCKETS; ++j) {
+            if (stats->histo[j]) {
+                printf("  [2^%d]: %d\n", j, stats->histo[j]);
+            }
+        }
+    }
+}
+
+#endif
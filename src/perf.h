@@ -0,0 +1,103 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_PERF_H_
+#define DFUUSB_PERF_H_
+
+#include "libc/types.h"
+
+/*
+ * Per-block download latency instrumentation, based on cycle accurate
+ * timestamping. Each block goes through:
+ *
+ *   USB reception -> dfu_backend_write() -> WR_DMA_REQ sent
+ *                 -> WR_DMA_ACK received -> dfu_store_finished()
+ *
+ * and each phase duration is accumulated in a fixed-size log2 histogram.
+ * Uploaded blocks are accounted the same way, between dfu_backend_read()
+ * and dfu_load_finished().
+ * Compiled out when CONFIG_APP_DFUUSB_PERF is not set.
+ */
+typedef enum {
+    PERF_PHASE_USB = 0,  /* previous block stored -> block written by libdfu */
+    PERF_PHASE_REQ,      /* block written -> store request sent to dfucrypto */
+    PERF_PHASE_CRYPTO,   /* store request sent -> store acknowledged */
+    PERF_PHASE_STORE,    /* block written -> block store finished for libdfu */
+    PERF_PHASE_LOAD_USB, /* previous block loaded -> next block read by libdfu */
+    PERF_PHASE_LOAD,     /* block read by libdfu -> block load finished */
+    PERF_PHASE_DIGEST,   /* streaming digest update of a downloaded block */
+    PERF_PHASE_NUM
+} t_perf_phase;
+
+#define PERF_HISTO_BUCKETS 32
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    /* bucket i counts durations in [2^i, 2^(i+1)[ cycles */
+    uint32_t histo[PERF_HISTO_BUCKETS];
+} t_perf_stats;
+
+#if CONFIG_APP_DFUUSB_PERF
+
+void perf_block_received(void);
+
+void perf_block_requested(uint8_t slot);
+
+void perf_block_acked(uint8_t slot);
+
+void perf_block_stored(void);
+
+void perf_load_requested(void);
+
+void perf_load_finished(void);
+
+void perf_digest_begin(void);
+
+void perf_digest_end(void);
+
+const t_perf_stats *perf_get_stats(t_perf_phase phase);
+
+void perf_reset(void);
+
+void perf_dump(void);
+
+#else
+
+# define perf_block_received()     do {} while (0)
+# define perf_block_requested(slot) do { (void)(slot); } while (0)
+# define perf_block_acked(slot)     do { (void)(slot); } while (0)
+# define perf_block_stored()       do {} while (0)
+# define perf_load_requested()     do {} while (0)
+# define perf_load_finished()      do {} while (0)
+# define perf_digest_begin()       do {} while (0)
+# define perf_digest_end()         do {} while (0)
+# define perf_reset()              do {} while (0)
+# define perf_dump()               do {} while (0)
+
+#endif
+
+#endif/*!DFUUSB_PERF_H_*/
@@ -0,0 +1,73 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "stack.h"
+
+#if CONFIG_APP_DFUUSB_MIN_RAM
+
+#define STACK_PAINT     0xa5a5a5a5
+/* not painted: the current frame, and the bottom of the stack which
+ * also accounts for the frames above the caller (startup, _main) */
+#define STACK_GUARD     64
+#define STACK_MARGIN    512
+
+_Static_assert(CONFIG_APP_DFUUSB_STACKSIZE > 2 * STACK_MARGIN, "stack too small to be measured");
+
+static uint32_t *stack_top = NULL;
+static uint32_t *stack_bottom = NULL;
+
+/*
+ * Must be called early from _main(), the stack being considered as
+ * starting at the caller frame.
+ */
+void __attribute__((noinline)) stack_paint(void)
+{
+    volatile uint32_t *p;
+
+    stack_top = (uint32_t*)__builtin_frame_address(0);
+    stack_bottom = stack_top - ((CONFIG_APP_DFUUSB_STACKSIZE - STACK_MARGIN) / 4);
+    for (p = stack_bottom; p < stack_top - (STACK_GUARD / 4); ++p) {
+        *p = STACK_PAINT;
+    }
+}
+
+/*
+ * maximum stack depth below the stack_paint() caller, in bytes. Reaching
+ * the painted area size means that the stack may have overflowed.
+ */
+uint32_t stack_max_depth(void)
+{
+    const volatile uint32_t *p = stack_bottom;
+
+    if (stack_top == NULL) {
+        return 0;
+    }
+    while (p < stack_top && *p == STACK_PAINT) {
+        ++p;
+    }
+    return (uint32_t)((stack_top - p) * 4);
+}
+
+#endif
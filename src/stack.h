@@ -0,0 +1,49 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_STACK_H_
+#define DFUUSB_STACK_H_
+
+#include "libc/types.h"
+
+/*
+ * Stack depth measurement: the free part of the stack is painted at
+ * startup, and the maximum depth is deduced from the highest overwritten
+ * word. Compiled out when CONFIG_APP_DFUUSB_MIN_RAM is not set.
+ */
+#if CONFIG_APP_DFUUSB_MIN_RAM
+
+void stack_paint(void);
+
+uint32_t stack_max_depth(void);
+
+#else
+
+static inline void stack_paint(void) {}
+
+static inline uint32_t stack_max_depth(void) { return 0; }
+
+#endif
+
+#endif/*!DFUUSB_STACK_H_*/
@@ -0,0 +1,102 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/string.h"
+#include "automaton.h"
+#include "main.h"
+#include "stats.h"
+
+#if CONFIG_APP_DFUUSB_STATS
+
+static t_dfu_stats dfu_stats = { 0 };
+/* start of the current wait for dfucrypto */
+static uint64_t wait_start = 0;
+static bool waiting = false;
+
+void stats_reset(void)
+{
+    uint16_t chunk_size = dfu_stats.crypto_chunk_size;
+
+    memset((void*)&dfu_stats, 0, sizeof(dfu_stats));
+    dfu_stats.crypto_chunk_size = chunk_size;
+    waiting = false;
+}
+
+void stats_block_received(uint16_t size)
+{
+    dfu_stats.bytes_received += size;
+}
+
+void stats_block_stored(void)
+{
+    dfu_stats.blocks_stored++;
+}
+
+void stats_sanity_reject(void)
+{
+    dfu_stats.sanity_rejects++;
+}
+
+void stats_ipc_sent(void)
+{
+    dfu_stats.ipc_sent++;
+}
+
+void stats_ipc_received(void)
+{
+    dfu_stats.ipc_received++;
+}
+
+void stats_set_chunk_size(uint16_t size)
+{
+    dfu_stats.crypto_chunk_size = size;
+}
+
+/* the host is waiting for dfucrypto (store or header authentication) */
+void stats_wait_begin(void)
+{
+    if (!waiting) {
+        waiting = true;
+        wait_start = get_timestamp();
+    }
+}
+
+void stats_wait_end(void)
+{
+    if (waiting) {
+        waiting = false;
+        dfu_stats.crypto_wait += get_timestamp() - wait_start;
+    }
+}
+
+void stats_get(t_dfu_stats *stats)
+{
+    memcpy((void*)stats, (void*)&dfu_stats, sizeof(dfu_stats));
+    stats->state = get_task_state();
+    stats->ts_unit = CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES;
+    stats->timestamp = get_timestamp();
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_STATS_H_
+#define DFUUSB_STATS_H_
+
+#include "libc/types.h"
+
+/*
+ * Live transfer statistics, reported to the host by the GET_STATS vendor
+ * request. Counters are reset on each block 0.
+ * Compiled out when CONFIG_APP_DFUUSB_STATS is not set.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t  state;             /* current t_dfuusb_state */
+    uint8_t  ts_unit;           /* timestamp unit: 0 none, 1 ms, 2 us, 3 cycles */
+    uint16_t crypto_chunk_size;
+    uint32_t bytes_received;
+    uint32_t blocks_stored;     /* store requests acknowledged by dfucrypto */
+    uint32_t ipc_sent;
+    uint32_t ipc_received;
+    uint32_t sanity_rejects;    /* DNLOAD blocks refused by the sanity checks */
+    uint64_t crypto_wait;       /* time spent with the host waiting for dfucrypto */
+    uint64_t timestamp;         /* timestamp of the statistics */
+} t_dfu_stats;
+
+#if CONFIG_APP_DFUUSB_STATS
+
+void stats_reset(void);
+
+void stats_block_received(uint16_t size);
+
+void stats_block_stored(void);
+
+void stats_sanity_reject(void);
+
+void stats_ipc_sent(void);
+
+void stats_ipc_received(void);
+
+void stats_set_chunk_size(uint16_t size);
+
+void stats_wait_begin(void);
+
+void stats_wait_end(void);
+
+void stats_get(t_dfu_stats *stats);
+
+#else
+
+# define stats_reset()              do {} while (0)
+# define stats_block_received(size) do { (void)(size); } while (0)
+# define stats_block_stored()       do {} while (0)
+# define stats_sanity_reject()      do {} while (0)
+# define stats_ipc_sent()           do {} while (0)
+# define stats_ipc_received()       do {} while (0)
+# define stats_set_chunk_size(size) do { (void)(size); } while (0)
+# define stats_wait_begin()         do {} while (0)
+# define stats_wait_end()           do {} while (0)
+
+#endif
+
+#endif/*!DFUUSB_STATS_H_*/
@@ -0,0 +1,83 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/stdio.h"
+#include "main.h"
+#include "trace.h"
+
+#if TRACE_LEVEL > TRACE_LEVEL_NONE
+
+#define TRACE_ENTRIES CONFIG_APP_DFUUSB_TRACE_ENTRIES
+
+_Static_assert((TRACE_ENTRIES & (TRACE_ENTRIES - 1)) == 0, "trace ring size must be a power of two");
+
+typedef struct {
+    uint16_t ev;
+    uint16_t reserved;
+    uint32_t ts;
+    uint32_t a;
+    uint32_t b;
+} t_trace_entry;
+
+static t_trace_entry trace_ring[TRACE_ENTRIES];
+/* free running indexes, the ring index being taken modulo TRACE_ENTRIES */
+static uint32_t trace_head = 0;
+static uint32_t trace_tail = 0;
+static uint32_t trace_dropped = 0;
+
+void trace_event(t_trace_event ev, uint32_t a, uint32_t b)
+{
+    t_trace_entry *entry;
+
+    if (trace_head - trace_tail >= TRACE_ENTRIES) {
+        /* ring full: the oldest event is overwritten */
+        trace_tail++;
+        trace_dropped++;
+    }
+    entry = &trace_ring[trace_head & (TRACE_ENTRIES - 1)];
+    entry->ev = ev;
+    entry->ts = (uint32_t)get_timestamp();
+    entry->a = a;
+    entry->b = b;
+    trace_head++;
+}
+
+/* print the pending events, to be called when there is nothing else to do */
+void trace_drain(void)
+{
+    t_trace_entry *entry;
+
+    if (trace_dropped) {
+        printf("T %x 0 %x 0\n", TRACE_EV_DROPPED, trace_dropped);
+        trace_dropped = 0;
+    }
+    while (trace_tail != trace_head) {
+        entry = &trace_ring[trace_tail & (TRACE_ENTRIES - 1)];
+        printf("T %x %x %x %x\n", entry->ev, entry->ts, entry->a, entry->b);
+        trace_tail++;
+    }
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_TRACE_H_
+#define DFUUSB_TRACE_H_
+
+#include "libc/types.h"
+
+/*
+ * Binary trace ring. Hot path events are recorded as fixed-size entries
+ * (event id, timestamp, two arguments) instead of being printed, and the
+ * ring is drained to the console as raw hex records when the main loop is
+ * idle. tools/trace_decode.py decodes them on the host side.
+ * Events are only recorded from the main thread.
+ */
+#define TRACE_LEVEL_NONE  0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+#define TRACE_LEVEL CONFIG_APP_DFUUSB_TRACE_LEVEL
+
+/* NOTE: the host decoder parses this enum, keep one event per line */
+typedef enum {
+    TRACE_EV_DROPPED = 0,       /* a: number of dropped events */
+    TRACE_EV_STATE,             /* a: previous state, b: new state */
+    TRACE_EV_ILLEGAL_STATE,     /* a: current state, b: refused state */
+    TRACE_EV_WRITE,             /* a: block number, b: size */
+    TRACE_EV_BLOCK0,            /* new download started */
+    TRACE_EV_READ,              /* a: upload offset, b: size */
+    TRACE_EV_EOF,               /* a: state */
+    TRACE_EV_FIRST_CHUNK,       /* a: bytes received, b: crypto chunk size */
+    TRACE_EV_CHUNK_TOO_BIG,     /* a: crypto chunk size, b: max */
+    TRACE_EV_SANITY_ERR,        /* a: sanity check error, b: block number */
+    TRACE_EV_BLOCK_REFUSED,     /* a: block number, b: size */
+    TRACE_EV_NO_SLOT,           /* a: block number, b: busy ring slots */
+    TRACE_EV_SLOT_ERR,          /* a: acknowledged slot, b: expected slot */
+    TRACE_EV_BAD_STATE,         /* a: state, b: block number */
+    TRACE_EV_RESUME_ERR,        /* a: block number, b: resume block */
+    TRACE_EV_HEADER_VALID,      /* a: crypto chunk size */
+    TRACE_EV_HEADER_VALID_ERR,  /* a: IPC data size */
+    TRACE_EV_CHUNK_SIZE_ERR,    /* a: crypto chunk size, b: DFU transfer size */
+    TRACE_EV_HEADER_INVALID,    /* a: IPC state */
+    TRACE_EV_IPC_UNKNOWN,       /* a: IPC magic */
+    TRACE_EV_TARGET,            /* a: target image, b: images following */
+    TRACE_EV_TARGET_ERR,        /* a: target image, b: images following */
+    TRACE_EV_RECOVER,           /* a: failed crypto chunk, b: t_trace_sanity */
+    TRACE_EV_RECOVER_ERR,       /* a: block number, b: failed crypto chunk */
+    TRACE_EV_AUTH_BUFFERED,     /* a: block number, b: buffered blocks */
+    TRACE_EV_USB_EV_DROPPED,    /* a: dropped USB events */
+    TRACE_EV_XFER_NEGOTIATED,   /* a: crypto chunk size, b: advised transfer size */
+    TRACE_EV_HEADER_CHECK_ERR,  /* a: t_trace_header_check, b: faulty field */
+    TRACE_EV_ERASE,             /* a: length to erase */
+    TRACE_EV_ERASE_DONE,        /* a: bytes erased */
+    TRACE_EV_ERASE_ERR,         /* a: bytes erased, b: IPC state */
+    TRACE_EV_IPC_OVERFLOW,      /* a: deferred IPCs */
+    TRACE_EV_STORE_ERR,         /* a: block number (0 on ack), b: slot */
+    TRACE_EV_TARGET_TIMEOUT,    /* a: last target image, b: images following */
+    TRACE_EV_STACK_DEPTH,       /* a: maximum stack depth, b: stack size */
+    TRACE_EV_IPC_STALE,         /* a: IPC magic, b: current state */
+    TRACE_EV_NUM
+} t_trace_event;
+
+/* dnload_transfers_sanity_check() errors */
+typedef enum {
+    TRACE_SANITY_GEOMETRY = 0,
+    TRACE_SANITY_HEADER_CHUNK,
+    TRACE_SANITY_SIZE,
+    TRACE_SANITY_SEQUENCE
+} t_trace_sanity;
+
+/* dfu_header_check() errors */
+typedef enum {
+    TRACE_HEADER_PARSE = 0,
+    TRACE_HEADER_MAGIC,
+    TRACE_HEADER_TYPE,
+    TRACE_HEADER_VERSION,
+    TRACE_HEADER_LEN,
+    TRACE_HEADER_SIGLEN,
+    TRACE_HEADER_CHUNK
+} t_trace_header_check;
+
+#if TRACE_LEVEL > TRACE_LEVEL_NONE
+
+void trace_event(t_trace_event ev, uint32_t a, uint32_t b);
+
+void trace_drain(void);
+
+#else
+
+# define trace_drain() do {} while (0)
+
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+# define TRACE_ERR(ev, a, b)  trace_event((ev), (uint32_t)(a), (uint32_t)(b))
+#else
+# define TRACE_ERR(ev, a, b)  do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+# define TRACE_INFO(ev, a, b) trace_event((ev), (uint32_t)(a), (uint32_t)(b))
+#else
+# define TRACE_INFO(ev, a, b) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+# define TRACE_DBG(ev, a, b)  trace_event((ev), (uint32_t)(a), (uint32_t)(b))
+#else
+# define TRACE_DBG(ev, a, b)  do {} while (0)
+#endif
+
+#endif/*!DFUUSB_TRACE_H_*/
@@ -0,0 +1,165 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/types.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libusbctrl.h"
+#include "handlers.h"
+#include "automaton.h"
+#include "digest.h"
+#include "stats.h"
+#include "event.h"
+#include "vendor.h"
+
+#if CONFIG_APP_DFUUSB_VENDOR_RQST
+
+#define USB_RQST_TYPE_MASK   0x60
+#define USB_RQST_TYPE_VENDOR 0x40
+
+static usbctrl_interface_t vendor_iface = { 0 };
+
+/* reply buffer, which must stay valid up to the end of the data stage */
+static union {
+#if CONFIG_APP_DFUUSB_RESUME
+    t_dfu_resume_info resume;
+#endif
+#if CONFIG_APP_DFUUSB_DIGEST
+    t_dfu_digest_info digest;
+#endif
+#if CONFIG_APP_DFUUSB_STATS
+    t_dfu_stats stats;
+#endif
+#if CONFIG_APP_DFUUSB_CHUNK_RETRY
+    t_dfu_recovery_info recovery;
+#endif
+    t_dfu_xfer_info xfer;
+    struct __attribute__((packed)) {
+        uint8_t  current;
+        uint32_t illegal_transitions;
+        t_dfuusb_state_stats states[DFUUSB_STATE_NUM];
+    } states;
+} vendor_reply;
+
+static mbed_error_t dfuusb_vendor_send(uint16_t size, uint16_t wLength)
+{
+    /* never sending more than what the host asked for */
+    if (size > wLength) {
+        size = wLength;
+    }
+    usb_backend_drv_send_data((uint8_t*)&vendor_reply, size, EP0);
+    usb_backend_drv_ack(EP0, USB_BACKEND_DRV_EP_DIR_OUT);
+    return MBED_ERROR_NONE;
+}
+
+/* refused request: the status stage is stalled */
+static mbed_error_t dfuusb_vendor_refuse(mbed_error_t err)
+{
+    usb_backend_drv_stall(EP0, USB_BACKEND_DRV_EP_DIR_OUT);
+    return err;
+}
+
+static mbed_error_t dfuusb_vendor_rqst_handler(uint32_t usbxdci_handler,
+                                               usbctrl_setup_pkt_t *packet)
+{
+    usbxdci_handler = usbxdci_handler;
+
+    if ((packet->bmRequestType & USB_RQST_TYPE_MASK) != USB_RQST_TYPE_VENDOR) {
+        return MBED_ERROR_UNSUPORTED_CMD;
+    }
+    switch (packet->bRequest) {
+#if CONFIG_APP_DFUUSB_RESUME
+        case DFUUSB_VENDOR_GET_RESUME:
+            dfu_handler_get_resume_info(&vendor_reply.resume);
+            return dfuusb_vendor_send(sizeof(vendor_reply.resume), packet->wLength);
+#endif
+#if CONFIG_APP_DFUUSB_DIGEST
+        case DFUUSB_VENDOR_GET_DIGEST:
+            digest_get_info(&vendor_reply.digest);
+            return dfuusb_vendor_send(sizeof(vendor_reply.digest), packet->wLength);
+#endif
+#if CONFIG_APP_DFUUSB_STATS
+        case DFUUSB_VENDOR_GET_STATS:
+            stats_get(&vendor_reply.stats);
+            return dfuusb_vendor_send(sizeof(vendor_reply.stats), packet->wLength);
+#endif
+#if CONFIG_APP_DFUUSB_CHUNK_RETRY
+        case DFUUSB_VENDOR_GET_RECOVERY:
+            dfu_handler_get_recovery_info(&vendor_reply.recovery);
+            return dfuusb_vendor_send(sizeof(vendor_reply.recovery), packet->wLength);
+#endif
+        case DFUUSB_VENDOR_GET_XFER_SIZE:
+            dfu_handler_get_xfer_info(&vendor_reply.xfer);
+            return dfuusb_vendor_send(sizeof(vendor_reply.xfer), packet->wLength);
+        case DFUUSB_VENDOR_GET_STATES:
+            vendor_reply.states.current = get_task_state();
+            vendor_reply.states.illegal_transitions = get_illegal_transitions();
+            for (uint8_t i = 0; i < DFUUSB_STATE_NUM; ++i) {
+                get_state_stats(i, &vendor_reply.states.states[i]);
+            }
+            return dfuusb_vendor_send(sizeof(vendor_reply.states), packet->wLength);
+        case DFUUSB_VENDOR_SET_UPLOAD_OFFSET:
+            /* applied by the main thread, before the next UPLOAD */
+            if (dfuusb_event_push(DFUUSB_EV_UPLOAD_OFFSET, packet->wValue)) {
+                return dfuusb_vendor_refuse(MBED_ERROR_NOSTORAGE);
+            }
+            usb_backend_drv_send_zlp(EP0);
+            return MBED_ERROR_NONE;
+#if CONFIG_APP_DFUUSB_MULTI_IMAGE
+        case DFUUSB_VENDOR_SET_TARGET:
+            /* the host must not believe the target switched if refused */
+            if (dfu_handler_check_target(packet->wValue & 0xff, packet->wValue >> 8)) {
+                return dfuusb_vendor_refuse(MBED_ERROR_INVPARAM);
+            }
+            /* applied by the main thread, before the next DNLOAD */
+            if (dfuusb_event_push(DFUUSB_EV_TARGET, packet->wValue)) {
+                return dfuusb_vendor_refuse(MBED_ERROR_NOSTORAGE);
+            }
+            usb_backend_drv_send_zlp(EP0);
+            return MBED_ERROR_NONE;
+#endif
+        default:
+            return MBED_ERROR_UNSUPORTED_CMD;
+    }
+}
+
+void dfuusb_vendor_declare(uint32_t usbxdci_handler)
+{
+    mbed_error_t errcode;
+
+    vendor_iface.usb_class = USB_CLASS_VENDOR_SPEC;
+    vendor_iface.usb_subclass = 0;
+    vendor_iface.usb_protocol = 0;
+    vendor_iface.dedicated = false;
+    vendor_iface.rqst_handler = dfuusb_vendor_rqst_handler;
+    /* control requests only, no endpoint */
+    vendor_iface.usb_ep_number = 0;
+
+    errcode = usbctrl_declare_interface(usbxdci_handler, &vendor_iface);
+    if (errcode != MBED_ERROR_NONE) {
+        printf("Error: unable to declare vendor interface: %d\n", errcode);
+    }
+}
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DFUUSB_VENDOR_H_
+#define DFUUSB_VENDOR_H_
+
+#include "libc/types.h"
+
+/*
+ * dfuusb vendor specific control requests (bmRequestType: vendor,
+ * interface), handled on a dedicated vendor interface declared to
+ * libusbctrl next to the DFU one.
+ */
+#define DFUUSB_VENDOR_GET_RESUME    0x01
+/*
+ * host to device, no data: upload offset in wValue, in blocks of the DFU
+ * transfer size in use (GET_XFER_SIZE), wIndex being the interface
+ */
+#define DFUUSB_VENDOR_SET_UPLOAD_OFFSET 0x02
+/*
+ * device to host: t_dfu_digest_info (digest.h) of the image data forwarded
+ * to dfucrypto. The header crypto chunk is not included, as it is
+ * authenticated by dfucrypto: the digest covers the image from the first
+ * byte following it. Final once the download is finished, invalid once a
+ * part of the image has been sent again (resume, chunk retry).
+ */
+#define DFUUSB_VENDOR_GET_DIGEST    0x03
+#define DFUUSB_VENDOR_GET_STATES    0x04
+/*
+ * host to device, no data: target image in the wValue LSB, number of images
+ * following it in the session in the wValue MSB
+ */
+#define DFUUSB_VENDOR_SET_TARGET    0x05
+#define DFUUSB_VENDOR_GET_STATS     0x06
+#define DFUUSB_VENDOR_GET_RECOVERY  0x07
+#define DFUUSB_VENDOR_GET_XFER_SIZE 0x08
+
+void dfuusb_vendor_declare(uint32_t usbxdci_handler);
+
+#endif/*!DFUUSB_VENDOR_H_*/
@@ -0,0 +1,90 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host build configuration, included before each source: the Kconfig
+ * defaults of the options taking a value. The boolean options are unset,
+ * the build variants of the Makefile setting them with -D.
+ */
+#ifndef HOST_CONFIG_H_
+#define HOST_CONFIG_H_
+
+#define CONFIG_APP_DFUUSB 1
+#define CONFIG_APP_DFUUSB_USR_DRV_USB_HS 1
+
+#ifndef CONFIG_APP_DFUUSB_SHM_SLOT_SIZE
+# define CONFIG_APP_DFUUSB_SHM_SLOT_SIZE 4096
+#endif
+#ifndef CONFIG_APP_DFUUSB_SHM_SLOTS
+# define CONFIG_APP_DFUUSB_SHM_SLOTS 1
+#endif
+#ifndef CONFIG_APP_DFUUSB_HEADER_LEN
+# define CONFIG_APP_DFUUSB_HEADER_LEN 256
+#endif
+#ifndef CONFIG_APP_DFUUSB_MAX_CHUNK_LEN
+# define CONFIG_APP_DFUUSB_MAX_CHUNK_LEN 65536
+#endif
+#ifndef CONFIG_APP_DFUUSB_EVENT_TIMEOUT
+# define CONFIG_APP_DFUUSB_EVENT_TIMEOUT 50
+#endif
+#ifndef CONFIG_APP_DFUUSB_TRACE_LEVEL
+# define CONFIG_APP_DFUUSB_TRACE_LEVEL 2
+#endif
+#ifndef CONFIG_APP_DFUUSB_TRACE_ENTRIES
+# define CONFIG_APP_DFUUSB_TRACE_ENTRIES 64
+#endif
+#ifndef CONFIG_APP_DFUUSB_FW_MAGIC
+# define CONFIG_APP_DFUUSB_FW_MAGIC 0x0
+#endif
+#ifndef CONFIG_APP_DFUUSB_FW_TYPES
+# define CONFIG_APP_DFUUSB_FW_TYPES 0x0
+#endif
+#ifndef CONFIG_APP_DFUUSB_FW_MIN_VERSION
+# define CONFIG_APP_DFUUSB_FW_MIN_VERSION 0
+#endif
+#ifndef CONFIG_APP_DFUUSB_FW_MAX_LEN
+# define CONFIG_APP_DFUUSB_FW_MAX_LEN 0x100000
+#endif
+#ifndef CONFIG_APP_DFUUSB_MAX_IMAGES
+# define CONFIG_APP_DFUUSB_MAX_IMAGES 2
+#endif
+#ifndef CONFIG_APP_DFUUSB_MULTI_IMAGE_TIMEOUT
+# define CONFIG_APP_DFUUSB_MULTI_IMAGE_TIMEOUT 10000
+#endif
+#ifndef CONFIG_APP_DFUUSB_STACKSIZE
+# define CONFIG_APP_DFUUSB_STACKSIZE 8192
+#endif
+/* microsecond timestamps: the per state times are reported in us */
+#ifndef CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES
+# define CONFIG_APP_DFUUSB_PERM_TIM_GETCYCLES 2
+#endif
+
+#if CONFIG_APP_DFUUSB_DIGEST_SHA256
+# error "no libsig in the host build"
+#endif
+#if CONFIG_APP_DFUUSB_MIN_RAM
+# error "the stack painting does not apply to the host build"
+#endif
+
+#endif/*!HOST_CONFIG_H_*/
@@ -0,0 +1,712 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Simulated dfucrypto peer: startup handshake, header authentication,
+ * decryption and flash programming of the store requests, background
+ * erase. Requests are handled in order, the next one once the acknowledge
+ * of the previous one is received by dfuusb. The stored data are checked
+ * against the image, each data byte having to be written exactly once
+ * (except after a rewind of the host), and the whole stored image once
+ * the download is finished.
+ *
+ * The flash follows the STM32F4 sector map (4 x 16K, 64K, 7 x 128K per
+ * MB), the target range starting at flash_offset in the bank.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipc_ext.h"
+#include "dmashm.h"
+#include "crc32.h"
+#include "libfw.h"
+#include "sim.h"
+
+#undef printf
+
+#define PEER_QUEUE_MAX      16
+#define PEER_OUTBOX_MAX     8
+#define FLASH_SECTORS_MAX   24
+
+typedef struct {
+    uint8_t  msg[DFUUSB_IPC_MSG_MAX];
+    uint32_t size;
+    uint64_t at;                /* sent by dfucrypto */
+} t_peer_msg;
+
+typedef enum {
+    HS_INIT,        /* waiting for end_of_init */
+    HS_BOOT,        /* acknowledged, initializing */
+    HS_READY,       /* ready sent, waiting for the ready response */
+    HS_SHM_INFO,    /* legacy: waiting for the DMA SHM address and size */
+    HS_DONE,
+} t_peer_hs;
+
+typedef enum {
+    JOB_NONE,
+    JOB_CPU,        /* request handling, decryption */
+    JOB_FLASH_WAIT, /* store waiting for the flash */
+    JOB_PROGRAM,    /* store programming, erase included */
+} t_peer_job;
+
+static struct {
+    t_peer_hs  hs;
+    uint64_t   boot_at;
+    uint8_t    version;         /* IPC framing in use */
+    /* requests received, the head one being handled */
+    t_peer_msg inbox[PEER_QUEUE_MAX];
+    uint8_t    in_head;
+    uint8_t    in_count;
+    uint8_t    in_max;
+    /* messages to dfuusb, the peer being blocked sending them */
+    t_peer_msg outbox[PEER_OUTBOX_MAX];
+    uint8_t    out_head;
+    uint8_t    out_count;
+    bool       wake;
+    /* head request handling */
+    t_peer_job job;
+    uint64_t   job_end;
+    uint32_t   job_offset;      /* image data offset of the store */
+    uint32_t   job_size;
+    uint8_t    job_slot;
+    /* header authentication */
+    uint8_t    header[CONFIG_APP_DFUUSB_HEADER_LEN];
+    uint32_t   header_len;
+    /* flash */
+    uint8_t    first_sector;
+    uint8_t    sectors;
+    bool       erased[FLASH_SECTORS_MAX];
+    bool       bg_active;
+    uint8_t    bg_next;
+    int8_t     bg_sector;       /* sector being erased in background, -1 if none */
+    uint64_t   bg_end;
+    uint32_t   bg_len;
+    /* verification */
+    uint8_t   *written;
+    uint8_t   *flash;           /* stored image data */
+    uint32_t   rewrite_from;    /* data offset from which stores may be done again */
+    bool       committed;
+    uint8_t    images;          /* images committed, waiting for the next one */
+    uint8_t    target;
+    /* statistics */
+    uint32_t   stores;
+    uint64_t   stored_bytes;
+    uint32_t   reads;
+    uint64_t   read_bytes;
+    uint32_t   received;        /* messages received by dfuusb */
+    uint64_t   recv_latency;    /* from their sending, summed */
+    uint64_t   recv_latency_max;
+    uint64_t   t_decrypt;
+    uint64_t   t_program;
+    uint64_t   t_erase;
+    uint64_t   t_auth;
+} peer = { 0 };
+
+/* STM32F4 sector of a bank offset */
+static uint8_t flash_sector(uint32_t addr)
+{
+    uint32_t bank = addr / 0x100000;
+    uint32_t off = addr % 0x100000;
+    uint8_t idx;
+
+    if (off < 0x10000) {
+        idx = off / 0x4000;
+    } else if (off < 0x20000) {
+        idx = 4;
+    } else {
+        idx = 5 + (off - 0x20000) / 0x20000;
+    }
+    return bank * 12 + idx;
+}
+
+static uint32_t flash_sector_start(uint8_t sector)
+{
+    uint32_t base = (sector / 12) * 0x100000;
+    uint8_t idx = sector % 12;
+
+    if (idx < 4) {
+        return base + idx * 0x4000;
+    }
+    if (idx == 4) {
+        return base + 0x10000;
+    }
+    return base + 0x20000 + (idx - 5) * 0x20000;
+}
+
+static uint32_t flash_sector_size(uint8_t sector)
+{
+    uint8_t idx = sector % 12;
+
+    return (idx < 4) ? 0x4000 : (idx == 4) ? 0x10000 : 0x20000;
+}
+
+static uint32_t flash_erase_time(uint8_t sector)
+{
+    switch (flash_sector_size(sector)) {
+        case 0x4000:
+            return sim_model.erase16_us;
+        case 0x10000:
+            return sim_model.erase64_us;
+        default:
+            return sim_model.erase128_us;
+    }
+}
+
+/* image data bytes covered up to the end of the given sector of the range */
+static uint32_t flash_erased_bytes(uint8_t sector)
+{
+    uint32_t end = flash_sector_start(peer.first_sector + sector) +
+                   flash_sector_size(peer.first_sector + sector) - sim_model.flash_offset;
+
+    return (end < sim_image.len) ? end : sim_image.len;
+}
+
+/* sectors of the range, relative to the first one */
+static void flash_range(uint32_t offset, uint32_t size, uint8_t *first, uint8_t *last)
+{
+    *first = flash_sector(sim_model.flash_offset + offset) - peer.first_sector;
+    *last = flash_sector(sim_model.flash_offset + offset + size - 1) - peer.first_sector;
+}
+
+static void peer_push(uint8_t magic, uint8_t state, uint8_t data_size,
+                      const void *payload, uint8_t payload_len)
+{
+    t_peer_msg *out;
+    t_dfuusb_ipc_msg *msg;
+
+    if (peer.out_count >= PEER_OUTBOX_MAX) {
+        sim_finish("dfucrypto: too many messages pending for dfuusb");
+    }
+    out = &peer.outbox[(peer.out_head + peer.out_count) % PEER_OUTBOX_MAX];
+    memset(out, 0, sizeof(*out));
+    msg = (t_dfuusb_ipc_msg*)out->msg;
+    msg->magic = magic;
+    msg->state = state;
+    msg->data_size = data_size;
+    memcpy(msg->data.u8, payload, payload_len);
+    out->at = sim_now();
+    if (peer.version >= 1) {
+        msg->version = peer.version;
+        out->size = DFUUSB_IPC_HDR_SIZE + payload_len;
+    } else {
+        out->size = (payload_len || data_size) ? sizeof(struct sync_command_data)
+                                               : sizeof(struct sync_command);
+    }
+    peer.out_count++;
+    peer.wake = true;
+    sim_log("dfucrypto: send %x:%x\n", magic, state);
+}
+
+static void peer_push_u16(uint8_t magic, uint8_t state, uint16_t value)
+{
+    peer_push(magic, state, 1, &value, sizeof(value));
+}
+
+static void peer_push_u32(uint8_t magic, uint8_t state, uint32_t value)
+{
+    peer_push(magic, state, DFUUSB_IPC_WORDS(4), &value, sizeof(value));
+}
+
+static t_dfuusb_ipc_msg *peer_request(void)
+{
+    return (t_dfuusb_ipc_msg*)peer.inbox[peer.in_head].msg;
+}
+
+static void peer_request_done(void)
+{
+    peer.in_head = (peer.in_head + 1) % PEER_QUEUE_MAX;
+    peer.in_count--;
+    peer.job = JOB_NONE;
+}
+
+/* DMA SHM slot, as mapped by dfucrypto */
+static uint8_t *peer_slot(uint8_t slot, uint32_t size)
+{
+    if (slot >= DMASHM_SLOTS ||
+        (uint32_t)slot * DMASHM_SLOT_SIZE + size > DMASHM_SLOTS * DMASHM_SLOT_SIZE) {
+        sim_finish("dfucrypto: DMA SHM access out of bounds, slot %u size %u", slot, size);
+    }
+    return dmashm_get_buf() + slot * DMASHM_SLOT_SIZE;
+}
+
+/* decryption of the store: the DMA reads the slot now */
+static uint32_t peer_store_begin(const t_dfuusb_ipc_msg *req)
+{
+    uint32_t i;
+
+    peer.job_size = req->data.u16[0];
+    peer.job_offset = (uint32_t)req->data.u16[1] * host_xfer_size();
+    peer.job_slot = (req->data_size >= 3) ? req->data.u16[2] : 0;
+    if (sim_scenario.images > 1 && peer.target != peer.images) {
+        sim_finish("dfucrypto: store for image %u with target %u", peer.images, peer.target);
+    }
+    if (peer.job_size == 0 || peer.job_offset + peer.job_size > sim_image.len) {
+        sim_finish("dfucrypto: store of %u bytes at offset %u out of the image",
+                   peer.job_size, peer.job_offset);
+    }
+    if (memcmp(peer_slot(peer.job_slot, peer.job_size),
+               sim_image.buf + sim_image.chunksize + peer.job_offset, peer.job_size)) {
+        sim_finish("dfucrypto: slot %u does not hold the image data at offset %u",
+                   peer.job_slot, peer.job_offset);
+    }
+    for (i = 0; i < peer.job_size; ++i) {
+        if (peer.written[peer.job_offset + i] && peer.job_offset + i < peer.rewrite_from) {
+            sim_finish("dfucrypto: image data at offset %u written twice",
+                       peer.job_offset + i);
+        }
+        peer.written[peer.job_offset + i] = 1;
+    }
+    memcpy(peer.flash + peer.job_offset, peer_slot(peer.job_slot, peer.job_size), peer.job_size);
+    peer.t_decrypt += (uint64_t)peer.job_size * sim_model.decrypt_us_kb / 1024;
+    return (uint64_t)peer.job_size * sim_model.decrypt_us_kb / 1024;
+}
+
+static void peer_header_check(const uint8_t *header, uint32_t len)
+{
+    if (len == CONFIG_APP_DFUUSB_HEADER_LEN &&
+        !memcmp(header, sim_image.buf, CONFIG_APP_DFUUSB_HEADER_LEN)) {
+        peer_push_u16(MAGIC_DFU_HEADER_VALID, SYNC_DONE, sim_image.chunksize);
+    } else {
+        peer_push(MAGIC_DFU_HEADER_INVALID, SYNC_BADFILE, 0, NULL, 0);
+    }
+}
+
+static void peer_download_finished(uint8_t state)
+{
+    bool last = (peer.images + 1 >= sim_scenario.images);
+    uint32_t i;
+
+    for (i = 0; i < sim_image.len; ++i) {
+        if (peer.written[i] != 1) {
+            sim_finish("dfucrypto: download finished, image data at offset %u not written", i);
+        }
+    }
+    if (memcmp(peer.flash, sim_image.buf + sim_image.chunksize, sim_image.len)) {
+        sim_finish("dfucrypto: download finished, the stored image differs from the image");
+    }
+    if ((state == SYNC_DONE) != last) {
+        sim_finish("dfucrypto: image %u finished with state %x", peer.images, state);
+    }
+    if (!last) {
+        /* committed, the next image is written from scratch */
+        peer.images++;
+        memset(peer.written, 0, sim_image.len);
+        memset(peer.flash, 0xff, sim_image.len);
+        peer.rewrite_from = UINT32_MAX;
+        memset(peer.erased, 0, sizeof(peer.erased));
+        peer.bg_active = false;
+        return;
+    }
+    peer.committed = true;
+    sim_t_commit = sim_now();
+}
+
+static void peer_erase_request(uint32_t len)
+{
+    uint8_t last;
+
+    if (len != sim_image.len) {
+        sim_finish("dfucrypto: erase of %u bytes, for a %u bytes image", len, sim_image.len);
+    }
+    flash_range(0, len, &peer.bg_next, &last);
+    peer.bg_active = true;
+    peer.bg_len = len;
+}
+
+/* startup handshake, then the requests handled on reception */
+static void peer_handshake(const t_peer_msg *in)
+{
+    const t_dfuusb_ipc_msg *msg = (const t_dfuusb_ipc_msg*)in->msg;
+    uint8_t version;
+
+    switch (peer.hs) {
+        case HS_INIT:
+            if (msg->magic != MAGIC_TASK_STATE_CMD || msg->state != SYNC_READY) {
+                goto err;
+            }
+            peer_push(MAGIC_TASK_STATE_RESP, SYNC_ACKNOWLEDGE, 0, NULL, 0);
+            peer.hs = HS_BOOT;
+            peer.boot_at = sim_now() + sim_model.boot_us;
+            break;
+        case HS_READY:
+            if (msg->magic != MAGIC_TASK_STATE_RESP || msg->state != SYNC_READY) {
+                goto err;
+            }
+            if (in->size <= sizeof(struct sync_command)) {
+                /* legacy: the DMA SHM follows, not acknowledged */
+                peer.hs = HS_SHM_INFO;
+                break;
+            }
+            if (msg->data.u16[2] != DMASHM_SIZE || msg->data.u16[3] != DMASHM_SLOT_SIZE) {
+                sim_finish("dfucrypto: unexpected DMA SHM size %u, slot size %u",
+                           msg->data.u16[2], msg->data.u16[3]);
+            }
+            version = (msg->data_size >= DFUUSB_IPC_WORDS(9)) ? msg->data.u8[8] : 0;
+            peer_push(MAGIC_TASK_STATE_RESP, SYNC_ACKNOWLEDGE, 1,
+                      &sim_model.peer_version, 1);
+            peer.version = (version < sim_model.peer_version) ? version : sim_model.peer_version;
+            peer.hs = HS_DONE;
+            break;
+        case HS_SHM_INFO:
+            if (in->size != 8 || *(const uint16_t*)&in->msg[4] != DMASHM_SIZE) {
+                goto err;
+            }
+            peer.hs = HS_DONE;
+            break;
+        default:
+            goto err;
+    }
+    return;
+err:
+    sim_finish("dfucrypto: unexpected %x:%x during the startup handshake",
+               msg->magic, msg->state);
+}
+
+static void flash_dispatch(void);
+
+/* handling of the head request, once the CPU time is over */
+static void peer_request_end(void)
+{
+    t_dfuusb_ipc_msg *req = peer_request();
+    uint32_t len;
+
+    if (peer.hs != HS_DONE) {
+        peer_handshake(&peer.inbox[peer.in_head]);
+        peer_request_done();
+        return;
+    }
+    switch (req->magic) {
+        case MAGIC_DATA_WR_DMA_REQ:
+            peer.job = JOB_FLASH_WAIT;
+            flash_dispatch();
+            return;
+        case MAGIC_DFU_HEADER_SEND:
+            len = (peer.version >= 1 || req->data_size <= 32) ? req->data_size : 0;
+            if (len == 0) {
+                peer_header_check(peer.header, peer.header_len);
+                peer.header_len = 0;
+                break;
+            }
+            if (peer.header_len + len > sizeof(peer.header)) {
+                sim_finish("dfucrypto: header larger than %u bytes", (unsigned)sizeof(peer.header));
+            }
+            memcpy(peer.header + peer.header_len, req->data.u8, len);
+            peer.header_len += len;
+            break;
+        case MAGIC_DFU_HEADER_SHM:
+            len = req->data.u16[1];
+            if ((uint32_t)req->data.u16[0] + len > DMASHM_SIZE ||
+                crc32_update(0, dmashm_get_buf() + req->data.u16[0], len) != req->data.u32[1]) {
+                peer_push(MAGIC_DFU_HEADER_INVALID, SYNC_FAILURE, 0, NULL, 0);
+                break;
+            }
+            peer_header_check(dmashm_get_buf() + req->data.u16[0], len);
+            break;
+        case MAGIC_DATA_RD_DMA_REQ:
+            len = req->data.u16[0];
+            if (req->data.u32[1] >= sim_image.len) {
+                len = 0;
+            } else if (req->data.u32[1] + len > sim_image.len) {
+                len = sim_image.len - req->data.u32[1];
+            }
+            /* the target range holds the image, flashed before */
+            memcpy(peer_slot(req->data.u16[1], len),
+                   sim_image.buf + sim_image.chunksize + req->data.u32[1], len);
+            peer.reads++;
+            peer.read_bytes += len;
+            peer_push_u16(MAGIC_DATA_RD_DMA_ACK, SYNC_DONE, len);
+            break;
+        case MAGIC_DFU_DWNLOAD_FINISHED:
+            peer_download_finished(req->state);
+            break;
+        case MAGIC_REBOOT_REQUEST:
+            if (!peer.committed) {
+                sim_finish("dfucrypto: reboot requested before the download end");
+            }
+            sim_finish(NULL);
+        case MAGIC_DFU_ERASE:
+            peer_erase_request(req->data.u32[0]);
+            flash_dispatch();
+            break;
+        case MAGIC_DFU_TARGET:
+            /* the host targets the images in order */
+            if (req->data.u8[0] != peer.images ||
+                req->data.u8[1] != sim_scenario.images - 1 - peer.images) {
+                sim_finish("dfucrypto: target %u with %u images following, for image %u",
+                           req->data.u8[0], req->data.u8[1], peer.images);
+            }
+            peer.target = req->data.u8[0];
+            break;
+        default:
+            sim_finish("dfucrypto: unexpected request %x:%x", req->magic, req->state);
+    }
+    peer_request_done();
+}
+
+/* start handling the head request, unless blocked sending to dfuusb */
+static void peer_schedule(void)
+{
+    const t_dfuusb_ipc_msg *req;
+    uint64_t cost = sim_model.ipc_us;
+
+    if (peer.job != JOB_NONE || peer.out_count || peer.in_count == 0) {
+        return;
+    }
+    req = peer_request();
+    if (peer.hs == HS_DONE) {
+        if (req->magic == MAGIC_DATA_WR_DMA_REQ) {
+            cost += peer_store_begin(req);
+        } else if ((req->magic == MAGIC_DFU_HEADER_SEND && req->data_size == 0) ||
+                   req->magic == MAGIC_DFU_HEADER_SHM) {
+            cost += sim_model.auth_us;
+            peer.t_auth += sim_model.auth_us;
+        } else if (req->magic == MAGIC_DATA_RD_DMA_REQ) {
+            cost += (uint64_t)req->data.u16[0] * sim_model.read_us_kb / 1024;
+        }
+    }
+    peer.job = JOB_CPU;
+    peer.job_end = sim_now() + cost;
+}
+
+/* give the flash to the waiting store, or to the background erase */
+static void flash_dispatch(void)
+{
+    uint64_t cost = 0;
+    uint8_t first, last, s;
+
+    if (peer.bg_sector >= 0 || peer.job == JOB_PROGRAM) {
+        return;
+    }
+    if (peer.job == JOB_FLASH_WAIT) {
+        flash_range(peer.job_offset, peer.job_size, &first, &last);
+        for (s = first; s <= last; ++s) {
+            if (peer.erased[s]) {
+                continue;
+            }
+            /* the background erase gets there first */
+            if (peer.bg_active && s >= peer.bg_next) {
+                goto bg;
+            }
+            cost += flash_erase_time(peer.first_sector + s);
+        }
+        peer.t_erase += cost;
+        for (s = first; s <= last; ++s) {
+            peer.erased[s] = true;
+        }
+        peer.t_program += (uint64_t)((peer.job_size + 3) / 4) * sim_model.prog_us_word;
+        cost += (uint64_t)((peer.job_size + 3) / 4) * sim_model.prog_us_word;
+        peer.job = JOB_PROGRAM;
+        peer.job_end = sim_now() + cost;
+        return;
+    }
+bg:
+    /* the next sector erase is started by dfucrypto, once not blocked
+     * sending the progress of the previous one */
+    if (peer.out_count) {
+        return;
+    }
+    while (peer.bg_active && peer.bg_next < peer.sectors && peer.erased[peer.bg_next]) {
+        peer.bg_next++;
+    }
+    if (!peer.bg_active || peer.bg_next >= peer.sectors) {
+        return;
+    }
+    peer.bg_sector = peer.bg_next;
+    peer.bg_end = sim_now() + flash_erase_time(peer.first_sector + peer.bg_sector);
+    peer.t_erase += flash_erase_time(peer.first_sector + peer.bg_sector);
+}
+
+static void peer_bg_erase_end(void)
+{
+    uint32_t erased = flash_erased_bytes(peer.bg_sector);
+
+    peer.erased[peer.bg_sector] = true;
+    peer.bg_sector = -1;
+    peer.bg_next++;
+    if (erased >= peer.bg_len) {
+        peer.bg_active = false;
+        peer_push_u32(MAGIC_DFU_ERASE, SYNC_DONE, erased);
+    } else {
+        peer_push_u32(MAGIC_DFU_ERASE, SYNC_WAIT, erased);
+    }
+    flash_dispatch();
+}
+
+static void peer_store_end(void)
+{
+    peer.stores++;
+    peer.stored_bytes += peer.job_size;
+    peer_push_u16(MAGIC_DATA_WR_DMA_ACK, SYNC_DONE, peer.job_slot);
+    if (sim_scenario.stray_ipc && peer.stores == 1) {
+        /* to be ignored by dfuusb, the download going on */
+        peer_push(0xee, SYNC_DONE, 0, NULL, 0);
+        peer_push_u16(MAGIC_DFU_HEADER_VALID, SYNC_DONE, sim_image.chunksize);
+        peer_push(MAGIC_DFU_HEADER_INVALID, SYNC_BADFILE, 0, NULL, 0);
+    }
+    peer_request_done();
+    flash_dispatch();
+}
+
+uint64_t peer_next_event(void)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (peer.hs == HS_BOOT) {
+        next = peer.boot_at;
+    }
+    if (peer.bg_sector >= 0 && peer.bg_end < next) {
+        next = peer.bg_end;
+    }
+    if ((peer.job == JOB_CPU || peer.job == JOB_PROGRAM) && peer.job_end < next) {
+        next = peer.job_end;
+    }
+    return next;
+}
+
+bool peer_handle_event(void)
+{
+    uint64_t now = sim_now();
+
+    peer.wake = false;
+    if (peer.hs == HS_BOOT && peer.boot_at <= now) {
+        /* end_of_cryp */
+        peer_push(MAGIC_TASK_STATE_CMD, SYNC_READY, 0, NULL, 0);
+        peer.hs = HS_READY;
+    } else if (peer.bg_sector >= 0 && peer.bg_end <= now) {
+        peer_bg_erase_end();
+    } else if (peer.job == JOB_CPU && peer.job_end <= now) {
+        peer_request_end();
+    } else if (peer.job == JOB_PROGRAM && peer.job_end <= now) {
+        peer_store_end();
+    }
+    peer_schedule();
+    return peer.wake;
+}
+
+bool peer_recv(const uint8_t *msg, uint32_t size)
+{
+    t_peer_msg *in;
+    uint8_t queue = (sim_model.peer_queue < PEER_QUEUE_MAX) ? sim_model.peer_queue : PEER_QUEUE_MAX;
+
+    if (peer.in_count >= queue) {
+        return false;
+    }
+    in = &peer.inbox[(peer.in_head + peer.in_count) % PEER_QUEUE_MAX];
+    memset(in, 0, sizeof(*in));
+    memcpy(in->msg, msg, size);
+    in->size = size;
+    peer.in_count++;
+    if (peer.in_count > peer.in_max) {
+        peer.in_max = peer.in_count;
+    }
+    sim_log("dfucrypto: recv %x:%x (%u bytes)\n", msg[0], msg[1], size);
+    peer_schedule();
+    if (peer.hs == HS_DONE && msg[0] == MAGIC_REBOOT_REQUEST) {
+        /* dfuusb freezes once the reboot is requested: running the
+         * pending requests up to the reset */
+        while (sim_wait_event()) {
+            continue;
+        }
+        sim_finish("dfucrypto: reboot request not handled");
+    }
+    return true;
+}
+
+bool peer_sending(void)
+{
+    return peer.out_count != 0;
+}
+
+bool peer_send(uint8_t *msg, uint32_t *size)
+{
+    t_peer_msg *out;
+
+    if (peer.out_count == 0) {
+        return false;
+    }
+    out = &peer.outbox[peer.out_head];
+    memcpy(msg, out->msg, out->size);
+    *size = out->size;
+    peer.received++;
+    peer.recv_latency += sim_now() - out->at;
+    if (sim_now() - out->at > peer.recv_latency_max) {
+        peer.recv_latency_max = sim_now() - out->at;
+    }
+    peer.out_head = (peer.out_head + 1) % PEER_OUTBOX_MAX;
+    peer.out_count--;
+    /* no longer blocked sending */
+    flash_dispatch();
+    peer_schedule();
+    return true;
+}
+
+void peer_init(void)
+{
+    uint8_t last;
+
+    if (sim_model.peer_queue == 0) {
+        sim_model.peer_queue = 1;
+    }
+    peer.bg_sector = -1;
+    peer.first_sector = flash_sector(sim_model.flash_offset);
+    last = flash_sector(sim_model.flash_offset + sim_image.len - 1);
+    peer.sectors = last - peer.first_sector + 1;
+    if (last >= FLASH_SECTORS_MAX) {
+        fprintf(stderr, "image beyond the simulated flash (%u sectors)\n", FLASH_SECTORS_MAX);
+        exit(2);
+    }
+    peer.written = calloc(1, sim_image.len);
+    peer.flash = malloc(sim_image.len);
+    if (peer.written == NULL || peer.flash == NULL) {
+        exit(2);
+    }
+    /* erased flash */
+    memset(peer.flash, 0xff, sim_image.len);
+    peer.rewrite_from = UINT32_MAX;
+}
+
+void peer_rewind(uint32_t offset)
+{
+    if (offset < peer.rewrite_from) {
+        peer.rewrite_from = offset;
+    }
+}
+
+void peer_report(void)
+{
+    printf("dfucrypto: %u stores, %llu bytes, %u reads, %llu bytes, queue %u/%u, framing v%u\n",
+           peer.stores, (unsigned long long)peer.stored_bytes, peer.reads,
+           (unsigned long long)peer.read_bytes, peer.in_max,
+           sim_model.peer_queue, peer.version);
+    printf("dfucrypto: %u messages received by dfuusb after %.1f us mean, %.1f us max\n",
+           peer.received, peer.received ? (double)peer.recv_latency / peer.received : 0.0,
+           (double)peer.recv_latency_max);
+    if (sim_scenario.images > 1) {
+        printf("dfucrypto: %u images committed before the last one, target %u\n",
+               peer.images, peer.target);
+    }
+    printf("dfucrypto: auth %.3f ms, decrypt %.3f ms, program %.3f ms, erase %.3f ms\n",
+           peer.t_auth / 1000.0, peer.t_decrypt / 1000.0,
+           peer.t_program / 1000.0, peer.t_erase / 1000.0);
+}
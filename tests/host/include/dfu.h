@@ -0,0 +1,76 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host build: libdfu API, implemented by the simulated libdfu and USB host
+ * (tests/host/libdfu.c).
+ */
+#ifndef HOST_DFU_H_
+#define HOST_DFU_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    ERRNONE = 0,
+    ERRTARGET,
+    ERRFILE,
+    ERRWRITE,
+    ERRERASE,
+    ERRCHECK_ERASED,
+    ERRPROG,
+    ERRVERIFY,
+    ERRADDRESS,
+    ERRNOTDONE,
+    ERRFIRMWARE,
+    ERRVENDOR,
+    ERRUSBR,
+    ERRPOR,
+    ERRUNKNOWN,
+    ERRSTALLEDPKT,
+} dfu_status_enum_t;
+
+void dfu_declare(uint32_t usbxdci_handler);
+
+void dfu_init(uint8_t *buffer, uint16_t max_size);
+
+void dfu_reinit(void);
+
+void dfu_exec_automaton(void);
+
+void dfu_store_finished(void);
+
+void dfu_load_finished(uint16_t bytes_read);
+
+void dfu_leave_session_with_error(dfu_status_enum_t status);
+
+/* backend, implemented by dfuusb */
+uint8_t dfu_backend_write(uint8_t * volatile data, const uint16_t data_size, uint16_t blocknum);
+
+uint8_t dfu_backend_read(uint8_t *data, uint16_t data_size);
+
+void dfu_backend_eof(void);
+
+void dfu_reset_device(void);
+
+#endif/*!HOST_DFU_H_*/
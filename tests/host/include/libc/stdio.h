@@ -0,0 +1,38 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host build: the task console goes through the simulator, which only
+ * prints it in verbose mode.
+ */
+#ifndef HOST_LIBC_STDIO_H_
+#define HOST_LIBC_STDIO_H_
+
+int sim_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#define printf sim_printf
+
+void aprintf_flush(void);
+
+#endif/*!HOST_LIBC_STDIO_H_*/
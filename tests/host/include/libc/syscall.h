@@ -0,0 +1,100 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host build: EwoK syscalls, implemented by the simulator on a virtual
+ * clock (tests/host/kernel.c).
+ */
+#ifndef HOST_LIBC_SYSCALL_H_
+#define HOST_LIBC_SYSCALL_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    SYS_E_DONE = 0,
+    SYS_E_INVAL,
+    SYS_E_DENIED,
+    SYS_E_BUSY,
+} e_syscall_ret;
+
+enum {
+    IPC_SEND_SYNC,
+    IPC_RECV_SYNC,
+    IPC_RECV_ASYNC,
+    IPC_SEND_ASYNC,
+};
+
+enum {
+    INIT_GETTASKID,
+    INIT_DMA_SHM,
+    INIT_DONE,
+    INIT_DEVACCESS,
+};
+
+enum {
+    SLEEP_MODE_INTERRUPTIBLE,
+    SLEEP_MODE_DEEP,
+};
+
+enum {
+    PREC_MILLI,
+    PREC_MICRO,
+    PREC_CYCLE,
+};
+
+typedef enum {
+    DMA_SHM_ACCESS_RD,
+    DMA_SHM_ACCESS_WR,
+} dma_shm_access_t;
+
+typedef struct {
+    uint8_t          target;
+    uint8_t          source;
+    physaddr_t       address;
+    uint16_t         size;
+    dma_shm_access_t mode;
+} dma_shm_t;
+
+/*
+ * sys_ipc(IPC_SEND_SYNC, uint8_t target, logsize_t size, const char *msg)
+ * sys_ipc(IPC_RECV_SYNC/ASYNC, uint8_t *source, logsize_t *size, char *msg)
+ */
+e_syscall_ret sys_ipc(uint32_t ipctype, ...);
+
+/*
+ * sys_init(INIT_GETTASKID, const char *name, uint8_t *id)
+ * sys_init(INIT_DMA_SHM, dma_shm_t *shm)
+ * sys_init(INIT_DONE)
+ */
+e_syscall_ret sys_init(uint32_t inittype, ...);
+
+e_syscall_ret sys_sleep(uint32_t ms, uint32_t mode);
+
+e_syscall_ret sys_get_systick(uint64_t *val, uint32_t prec);
+
+e_syscall_ret sys_yield(void);
+
+e_syscall_ret sys_reset(void);
+
+#endif/*!HOST_LIBC_SYSCALL_H_*/
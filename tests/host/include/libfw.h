@@ -0,0 +1,49 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host build: libfirmware header API (tests/host/libfirmware.c). The
+ * header layout is the one of the simulated images.
+ */
+#ifndef HOST_LIBFW_H_
+#define HOST_LIBFW_H_
+
+#include "libc/types.h"
+
+typedef struct __packed {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t version;
+    uint32_t len;
+    uint32_t siglen;
+    uint32_t chunksize;
+    uint8_t  hash[32];
+} firmware_header_t;
+
+int firmware_parse_header(uint8_t *buf, uint32_t len, uint32_t offset,
+                          firmware_header_t *header, uint8_t *sig);
+
+void firmware_print_header(firmware_header_t *header);
+
+#endif/*!HOST_LIBFW_H_*/
@@ -0,0 +1,99 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host build: libusbctrl and USB backend driver API
+ * (tests/host/libusbctrl.c). No USB traffic goes through it, the DFU
+ * requests being simulated at the libdfu level.
+ */
+#ifndef HOST_LIBUSBCTRL_H_
+#define HOST_LIBUSBCTRL_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    MBED_ERROR_NONE = 0,
+    MBED_ERROR_INVPARAM,
+    MBED_ERROR_UNSUPORTED_CMD,
+    MBED_ERROR_NOSTORAGE,
+    MBED_ERROR_UNKNOWN,
+} mbed_error_t;
+
+enum {
+    USB_OTG_HS_ID,
+    USB_OTG_FS_ID,
+};
+
+#define EP0 0
+
+typedef struct __packed {
+    uint8_t  bmRequestType;
+    uint8_t  bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} usbctrl_setup_pkt_t;
+
+typedef mbed_error_t (*usb_rqst_handler_t)(uint32_t usbxdci_handler, usbctrl_setup_pkt_t *packet);
+
+typedef enum {
+    USB_CLASS_VENDOR_SPEC = 0xff,
+} usb_class_t;
+
+typedef struct {
+    usb_class_t        usb_class;
+    uint8_t            usb_subclass;
+    uint8_t            usb_protocol;
+    bool               dedicated;
+    usb_rqst_handler_t rqst_handler;
+    uint8_t            usb_ep_number;
+} usbctrl_interface_t;
+
+typedef enum {
+    USB_BACKEND_DRV_EP_DIR_IN,
+    USB_BACKEND_DRV_EP_DIR_OUT,
+} usb_backend_drv_ep_dir_t;
+
+mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh);
+
+mbed_error_t usbctrl_initialize(uint32_t ctxh);
+
+mbed_error_t usbctrl_start_device(uint32_t ctxh);
+
+mbed_error_t usbctrl_declare_interface(uint32_t ctxh, usbctrl_interface_t *iface);
+
+mbed_error_t usb_backend_drv_send_data(uint8_t *src, uint32_t size, uint8_t ep);
+
+mbed_error_t usb_backend_drv_send_zlp(uint8_t ep);
+
+mbed_error_t usb_backend_drv_ack(uint8_t ep, usb_backend_drv_ep_dir_t dir);
+
+mbed_error_t usb_backend_drv_stall(uint8_t ep, usb_backend_drv_ep_dir_t dir);
+
+/* triggers, implemented by dfuusb */
+void usbctrl_reset_received(void);
+
+void usbctrl_configuration_set(void);
+
+#endif/*!HOST_LIBUSBCTRL_H_*/
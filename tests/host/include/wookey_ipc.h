@@ -0,0 +1,74 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host build: stand-in for the wookey IPC definitions shared by dfuusb and
+ * dfucrypto. Only the layouts matter here, both ends being built from it.
+ */
+#ifndef HOST_WOOKEY_IPC_H_
+#define HOST_WOOKEY_IPC_H_
+
+#include "libc/types.h"
+
+enum {
+    MAGIC_TASK_STATE_CMD = 1,
+    MAGIC_TASK_STATE_RESP,
+    MAGIC_DATA_WR_DMA_REQ,
+    MAGIC_DATA_WR_DMA_ACK,
+    MAGIC_DATA_RD_DMA_REQ,
+    MAGIC_DATA_RD_DMA_ACK,
+    MAGIC_DFU_HEADER_SEND,
+    MAGIC_DFU_HEADER_VALID,
+    MAGIC_DFU_HEADER_INVALID,
+    MAGIC_DFU_DWNLOAD_FINISHED,
+    MAGIC_REBOOT_REQUEST,
+};
+
+enum {
+    SYNC_READY = 1,
+    SYNC_ACKNOWLEDGE,
+    SYNC_DONE,
+    SYNC_WAIT,
+    SYNC_ASK_FOR_DATA,
+    SYNC_BADFILE,
+    SYNC_FAILURE,
+};
+
+struct sync_command {
+    uint8_t magic;
+    uint8_t state;
+};
+
+struct sync_command_data {
+    uint8_t magic;
+    uint8_t state;
+    uint8_t data_size;
+    union {
+        uint8_t  u8[32];
+        uint16_t u16[16];
+        uint32_t u32[8];
+    } data;
+};
+
+#endif/*!HOST_WOOKEY_IPC_H_*/
@@ -0,0 +1,228 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Simulated EwoK kernel: the syscalls used by dfuusb, dfucrypto being the
+ * only IPC peer.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "libc/syscall.h"
+#include "libc/malloc.h"
+#include "sim.h"
+
+#undef printf
+
+/* EwoK kernel IPC message size limit */
+#define SIM_IPC_MSG_MAX 128
+
+/* CPU cycles per us, for PREC_CYCLE */
+#define SIM_CYCLES_PER_US 168
+
+static struct {
+    uint32_t sends;
+    uint32_t busy;          /* sends refused, dfucrypto sending to us */
+    uint64_t send_wait;     /* blocked sending, up to dfucrypto reception */
+    uint32_t recvs;
+    uint64_t recv_wait;     /* blocked receiving */
+    uint32_t sleeps;
+    uint32_t timeouts;      /* sleeps not woken by an event */
+    uint64_t sleep_time;
+} kstats = { 0 };
+
+static e_syscall_ret kernel_send(const uint8_t *msg, logsize_t size)
+{
+    uint64_t start = sim_now();
+
+    if (size > SIM_IPC_MSG_MAX) {
+        return SYS_E_INVAL;
+    }
+    for (;;) {
+        /* both tasks sending to each other: the kernel refuses our send */
+        if (peer_sending()) {
+            kstats.busy++;
+            return SYS_E_BUSY;
+        }
+        if (peer_recv(msg, size)) {
+            break;
+        }
+        /* blocked up to the dfucrypto reception */
+        if (!sim_wait_event()) {
+            sim_finish("deadlock: dfuusb blocked sending to dfucrypto");
+        }
+    }
+    kstats.sends++;
+    kstats.send_wait += sim_now() - start;
+    return SYS_E_DONE;
+}
+
+static e_syscall_ret kernel_recv(uint8_t *source, logsize_t *size, char *msg, bool blocking)
+{
+    uint8_t buf[SIM_IPC_MSG_MAX];
+    uint64_t start = sim_now();
+    uint32_t len;
+
+    if (*source != SIM_ID_DFUCRYPTO) {
+        return SYS_E_INVAL;
+    }
+    while (!peer_send(buf, &len)) {
+        if (!blocking) {
+            return SYS_E_BUSY;
+        }
+        if (!sim_wait_event()) {
+            sim_finish("deadlock: dfuusb waiting for dfucrypto");
+        }
+    }
+    if (len > *size) {
+        sim_finish("IPC of %u bytes, larger than the %u bytes receive buffer",
+                   len, *size);
+    }
+    memcpy(msg, buf, len);
+    *size = len;
+    kstats.recvs++;
+    kstats.recv_wait += sim_now() - start;
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_ipc(uint32_t ipctype, ...)
+{
+    e_syscall_ret ret = SYS_E_INVAL;
+    uint8_t *source;
+    logsize_t *psize;
+    logsize_t size;
+    uint8_t target;
+    va_list ap;
+
+    sim_charge(sim_model.syscall_us);
+    va_start(ap, ipctype);
+    switch (ipctype) {
+        case IPC_SEND_SYNC:
+            target = (uint8_t)va_arg(ap, int);
+            size = va_arg(ap, logsize_t);
+            if (target != SIM_ID_DFUCRYPTO) {
+                break;
+            }
+            ret = kernel_send(va_arg(ap, const uint8_t*), size);
+            break;
+        case IPC_RECV_SYNC:
+        case IPC_RECV_ASYNC:
+            source = va_arg(ap, uint8_t*);
+            psize = va_arg(ap, logsize_t*);
+            ret = kernel_recv(source, psize, va_arg(ap, char*), ipctype == IPC_RECV_SYNC);
+            break;
+        default:
+            break;
+    }
+    va_end(ap);
+    return ret;
+}
+
+e_syscall_ret sys_init(uint32_t inittype, ...)
+{
+    e_syscall_ret ret = SYS_E_DONE;
+    const char *name;
+    uint8_t *id;
+    va_list ap;
+
+    va_start(ap, inittype);
+    switch (inittype) {
+        case INIT_GETTASKID:
+            name = va_arg(ap, const char*);
+            id = va_arg(ap, uint8_t*);
+            if (strcmp(name, "dfucrypto")) {
+                ret = SYS_E_INVAL;
+                break;
+            }
+            *id = SIM_ID_DFUCRYPTO;
+            break;
+        case INIT_DMA_SHM:
+        case INIT_DONE:
+            break;
+        default:
+            ret = SYS_E_INVAL;
+            break;
+    }
+    va_end(ap);
+    return ret;
+}
+
+e_syscall_ret sys_sleep(uint32_t ms, uint32_t mode)
+{
+    uint64_t start;
+
+    (void)mode;
+    sim_charge(sim_model.syscall_us);
+    start = sim_now();
+    if (!sim_wait_until(start + (uint64_t)ms * 1000)) {
+        kstats.timeouts++;
+    }
+    kstats.sleeps++;
+    kstats.sleep_time += sim_now() - start;
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_get_systick(uint64_t *val, uint32_t prec)
+{
+    switch (prec) {
+        case PREC_MILLI:
+            *val = sim_now() / 1000;
+            break;
+        case PREC_MICRO:
+            *val = sim_now();
+            break;
+        case PREC_CYCLE:
+            *val = sim_now() * SIM_CYCLES_PER_US;
+            break;
+        default:
+            return SYS_E_INVAL;
+    }
+    return SYS_E_DONE;
+}
+
+/* dfucrypto runs, if it has anything to do right now */
+e_syscall_ret sys_yield(void)
+{
+    sim_charge(sim_model.syscall_us);
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_reset(void)
+{
+    sim_finish("sys_reset()");
+}
+
+int wmalloc_init(void)
+{
+    return 0;
+}
+
+void kernel_report(void)
+{
+    printf("ipc: %u sent (%.3f ms blocked, %u refused busy), %u received (%.3f ms blocked)\n",
+           kstats.sends, kstats.send_wait / 1000.0, kstats.busy,
+           kstats.recvs, kstats.recv_wait / 1000.0);
+    printf("sleep: %u calls, %.3f ms, %u timed out\n", kstats.sleeps,
+           kstats.sleep_time / 1000.0, kstats.timeouts);
+}
@@ -0,0 +1,600 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Simulated libdfu, and the USB host driving it: the image is sent in
+ * DNLOAD blocks of the dfu_init() buffer size, each one followed by
+ * GETSTATUS requests up to the end of the store (dfuDNBUSY polling), then
+ * a zero length DNLOAD and the manifestation, resetting the device.
+ * Before, the host may read back the flashed image in UPLOAD blocks,
+ * each one checked against the image.
+ * When several images are downloaded, each one is preceded by a
+ * SET_TARGET vendor request, libdfu going back to dfuIDLE after the
+ * manifestation of the previous one (bitManifestationTolerant).
+ *
+ * The failure paths of the scenario are run once each: a block sent out
+ * of sequence (recovered from the chunk given by GET_RECOVERY), a USB
+ * reset during the download (resumed from the block given by GET_RESUME),
+ * a corrupted header (the download restarted after the expected error)
+ * and a crypto chunk size which is not a multiple of the transfer size
+ * (restarted with the size given by GET_XFER_SIZE).
+ */
+#include <stdio.h>
+#include <string.h>
+#include "dfu.h"
+#include "automaton.h"
+#include "handlers.h"
+#include "digest.h"
+#include "stats.h"
+#include "crc32.h"
+#include "trace.h"
+#include "vendor.h"
+#include "sim.h"
+
+#undef printf
+
+typedef enum {
+    HOST_DETACHED,  /* up to SetConfiguration */
+    HOST_UPLOAD,    /* UPLOAD request setup stage in progress */
+    HOST_UPLOAD_WAIT, /* waiting for the backend data */
+    HOST_UPLOAD_DATA, /* UPLOAD data stage in progress */
+    HOST_DNLOAD,    /* DNLOAD data stage in progress */
+    HOST_STATUS,    /* GETSTATUS request in progress */
+    HOST_MANIFEST,  /* manifestation, up to the device reset */
+    HOST_TARGET,    /* SET_TARGET request of the next image in progress */
+    HOST_DONE,
+} t_host_state;
+
+static struct {
+    uint8_t          *buf;
+    uint16_t          size;
+    uint16_t          xfer;         /* size of the DNLOAD blocks */
+    t_host_state      state;
+    uint64_t          next;
+    uint32_t          offset;       /* image offset of the current block */
+    uint16_t          len;          /* current block size, 0 for the last DNLOAD */
+    uint16_t          blocknum;
+    uint16_t          sent_blocknum; /* wBlockNum of the current block */
+    uint8_t           image;        /* index of the image being downloaded */
+    bool              landed;       /* block received, not yet handed to the backend */
+    bool              busy;         /* backend store in progress */
+    bool              eof;
+    bool              reading;      /* UPLOAD request not yet handed to the backend */
+    uint32_t          up_first;     /* image offset of the first UPLOAD block */
+    uint32_t          up_offset;    /* image offset of the current UPLOAD block */
+    uint16_t          up_len;       /* bytes of the current UPLOAD block */
+    uint32_t          up_blocks;
+    uint64_t          up_start;
+    uint64_t          up_time;
+    dfu_status_enum_t error;
+    uint32_t          blocks;
+    uint32_t          polls;
+    uint64_t          busy_time;    /* host waiting on dfuDNBUSY */
+    uint64_t          busy_since;
+    /* failure paths run */
+    uint32_t          recoveries;
+    uint32_t          resets;
+    uint32_t          resumes;
+    uint32_t          header_refusals;
+    uint32_t          negotiations;
+    uint32_t          restarts;     /* restarts in the middle of the image data */
+} dfu = { 0 };
+
+static void host_dnload(void)
+{
+    uint32_t left = sim_image.size - dfu.offset;
+
+    dfu.len = (left < dfu.xfer) ? left : dfu.xfer;
+    dfu.sent_blocknum = dfu.blocknum;
+    dfu.state = HOST_DNLOAD;
+    dfu.next = sim_now() + sim_model.usb_req_us +
+               (uint64_t)dfu.len * sim_model.usb_us_kb / 1024;
+}
+
+static void host_upload(void)
+{
+    dfu.state = HOST_UPLOAD;
+    dfu.next = sim_now() + sim_model.usb_req_us;
+}
+
+/* CLRSTATUS, then DNLOAD again from the given block */
+static void host_restart(uint16_t blocknum)
+{
+    dfu.error = ERRNONE;
+    dfu.landed = false;
+    dfu.busy = false;
+    dfu.eof = false;
+    dfu.blocknum = blocknum;
+    dfu.offset = (uint32_t)blocknum * dfu.xfer;
+    if (dfu.offset >= sim_image.chunksize) {
+        dfu.restarts++;
+        peer_rewind(dfu.offset - sim_image.chunksize);
+    }
+    sim_log("host: download restarted at block %u\n", blocknum);
+    host_dnload();
+}
+
+/* the out of sequence block is refused: the failed crypto chunk is sent again */
+static int host_recover(void)
+{
+#if CONFIG_APP_DFUUSB_CHUNK_RETRY
+    uint16_t blocks_per_chunk = sim_image.chunksize / dfu.xfer;
+    t_dfu_recovery_info info;
+    uint32_t size;
+
+    if (usb_vendor_request(true, DFUUSB_VENDOR_GET_RECOVERY, 0, sizeof(info), &info, &size) ||
+        size != sizeof(info)) {
+        sim_finish("GET_RECOVERY refused");
+    }
+    if (info.state != DFUUSB_STATE_RECOVER || info.reason != TRACE_SANITY_SEQUENCE ||
+        info.xfer_size != dfu.xfer || info.restart_block % blocks_per_chunk ||
+        info.restart_block > sim_scenario.refuse_block) {
+        sim_finish("GET_RECOVERY: state %u, reason %u, restart block %u, transfer size %u",
+                   info.state, info.reason, info.restart_block, info.xfer_size);
+    }
+    dfu.recoveries++;
+    host_restart(info.restart_block);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* enumerated again after the USB reset: the download goes on */
+static void host_resume(void)
+{
+#if CONFIG_APP_DFUUSB_RESUME
+    uint16_t blocks_per_chunk = sim_image.chunksize / dfu.xfer;
+    t_dfu_resume_info info;
+    uint32_t size;
+
+    if (usb_vendor_request(true, DFUUSB_VENDOR_GET_RESUME, 0, sizeof(info), &info, &size) ||
+        size != sizeof(info)) {
+        sim_finish("GET_RESUME refused");
+    }
+    if (!info.resumable || info.xfer_size != dfu.xfer ||
+        info.resume_block % blocks_per_chunk || info.resume_block < blocks_per_chunk ||
+        info.resume_block > sim_scenario.reset_block) {
+        sim_finish("GET_RESUME: resumable %u, resume block %u, transfer size %u",
+                   info.resumable, info.resume_block, info.xfer_size);
+    }
+    dfu.resumes++;
+    host_restart(info.resume_block);
+#else
+    sim_finish("USB reset without download resume");
+#endif
+}
+
+/* the chunk size is refused: restarting with the negotiated transfer size */
+static int host_negotiate(void)
+{
+#if CONFIG_APP_DFUUSB_VENDOR_RQST
+    t_dfu_xfer_info info;
+    uint32_t size;
+
+    if (usb_vendor_request(true, DFUUSB_VENDOR_GET_XFER_SIZE, 0, sizeof(info), &info, &size) ||
+        size != sizeof(info) || info.negotiated == 0 || info.negotiated == dfu.xfer ||
+        info.negotiated > info.wsize || sim_image.chunksize % info.negotiated) {
+        return -1;
+    }
+    sim_log("host: transfer size %u negotiated\n", info.negotiated);
+    dfu.xfer = info.negotiated;
+    dfu.negotiations++;
+    host_restart(0);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* DFU error status: only the failure paths of the scenario are expected */
+static void host_error(void)
+{
+    dfu_status_enum_t status = dfu.error;
+
+    sim_log("host: DFU status %d at block %u\n", status, dfu.blocknum);
+    if (status == ERRADDRESS && sim_scenario.refuse_block && dfu.recoveries == 0 &&
+        host_recover() == 0) {
+        return;
+    }
+    if (sim_scenario.bad_header && dfu.header_refusals == 0 && status == sim_scenario.bad_header) {
+        dfu.header_refusals++;
+        host_restart(0);
+        return;
+    }
+    if (status == ERRFILE && sim_scenario.negotiate && dfu.negotiations == 0 &&
+        host_negotiate() == 0) {
+        return;
+    }
+    sim_finish("DFU session left with error %d at block %u", status, dfu.blocknum);
+}
+
+/* the digest covers the image data forwarded to dfucrypto, not the header chunk */
+static void host_check_digest(void)
+{
+#if CONFIG_APP_DFUUSB_DIGEST
+    t_dfu_digest_info info;
+    uint32_t crc = crc32_update(0, sim_image.buf + sim_image.chunksize, sim_image.len);
+    uint32_t size;
+
+    if (usb_vendor_request(true, DFUUSB_VENDOR_GET_DIGEST, 0, sizeof(info), &info, &size) ||
+        size != sizeof(info)) {
+        sim_finish("GET_DIGEST refused");
+    }
+    /* the data stream is broken when a part of it is sent again */
+    if (dfu.restarts) {
+        if (info.state != DIGEST_STATE_INVALID) {
+            sim_finish("GET_DIGEST: state %u after a restart", info.state);
+        }
+        return;
+    }
+    if (info.state != DIGEST_STATE_FINAL || info.bytes != sim_image.len || info.crc32 != crc) {
+        sim_finish("GET_DIGEST: state %u, %u bytes, crc32 %08x, expected %u bytes, crc32 %08x",
+                   info.state, info.bytes, info.crc32, sim_image.len, crc);
+    }
+#else
+    sim_finish("no GET_DIGEST without CONFIG_APP_DFUUSB_DIGEST");
+#endif
+}
+
+static void host_check_vendor(void)
+{
+#if CONFIG_APP_DFUUSB_VENDOR_RQST
+    struct __attribute__((packed)) {
+        uint8_t  current;
+        uint32_t illegal_transitions;
+    } states;
+    t_dfu_xfer_info xfer;
+    uint32_t size;
+
+    if (usb_vendor_request(true, DFUUSB_VENDOR_GET_XFER_SIZE, 0, sizeof(xfer), &xfer, &size) ||
+        size != sizeof(xfer) || xfer.wsize != dfu.size || xfer.size != dfu.xfer) {
+        sim_finish("GET_XFER_SIZE: wTransferSize %u, transfer size %u", xfer.wsize, xfer.size);
+    }
+    /* the reply is truncated to wLength */
+    if (usb_vendor_request(true, DFUUSB_VENDOR_GET_STATES, 0, sizeof(states), &states, &size) ||
+        size != sizeof(states) || states.illegal_transitions != 0) {
+        sim_finish("GET_STATES: state %u, %u illegal transitions",
+                   states.current, states.illegal_transitions);
+    }
+# if CONFIG_APP_DFUUSB_STATS
+    {
+        t_dfu_stats stats;
+
+        if (usb_vendor_request(true, DFUUSB_VENDOR_GET_STATS, 0, sizeof(stats), &stats, &size) ||
+            size != sizeof(stats) || stats.crypto_chunk_size != sim_image.chunksize ||
+            stats.sanity_rejects != dfu.recoveries) {
+            sim_finish("GET_STATS: crypto chunk size %u, %u blocks refused",
+                       stats.crypto_chunk_size, stats.sanity_rejects);
+        }
+    }
+# endif
+    /* unknown requests are stalled */
+    if (usb_vendor_request(true, 0xff, 0, 64, NULL, NULL) == 0) {
+        sim_finish("unknown vendor request accepted");
+    }
+#else
+    sim_finish("no vendor requests without CONFIG_APP_DFUUSB_VENDOR_RQST");
+#endif
+}
+
+/* last DNLOAD done: each failure path of the scenario must have been run */
+static void host_check_download(void)
+{
+    if ((sim_scenario.refuse_block && dfu.recoveries == 0) ||
+        (sim_scenario.reset_block && dfu.resumes == 0) ||
+        (sim_scenario.bad_header && dfu.header_refusals == 0) ||
+        (sim_scenario.negotiate && dfu.negotiations == 0)) {
+        sim_finish("failure path not run: %u recoveries, %u resumes, %u header refusals, "
+                   "%u negotiations", dfu.recoveries, dfu.resumes, dfu.header_refusals,
+                   dfu.negotiations);
+    }
+    if (sim_scenario.digest) {
+        host_check_digest();
+    }
+    if (sim_scenario.vendor) {
+        host_check_vendor();
+    }
+}
+
+/* download of the current image, its target being selected first if several */
+static void host_image_start(void)
+{
+    uint16_t following = sim_scenario.images - 1 - dfu.image;
+
+    if (sim_scenario.images > 1 &&
+        usb_vendor_request(false, DFUUSB_VENDOR_SET_TARGET,
+                           dfu.image | (following << 8), 0, NULL, NULL)) {
+        sim_finish("SET_TARGET refused for image %u", dfu.image);
+    }
+    host_dnload();
+}
+
+/* readback done: the download follows, unless only the readback is measured */
+static void host_upload_end(void)
+{
+    dfu.up_time = sim_now() - dfu.up_start;
+    sim_log("host: upload of %u bytes done\n", dfu.up_offset - dfu.up_first);
+    if (sim_scenario.no_download) {
+        sim_t_start = dfu.up_start;
+        sim_t_commit = sim_now();
+        sim_finish(NULL);
+    }
+    sim_t_start = sim_now();
+    host_image_start();
+}
+
+void host_start(void)
+{
+    if (dfu.state != HOST_DETACHED) {
+        return;
+    }
+    if (dfu.size == 0) {
+        sim_finish("SetConfiguration before dfu_init()");
+    }
+    if (dfu.resets > dfu.resumes) {
+        host_resume();
+        return;
+    }
+    if (sim_scenario.upload) {
+        dfu.up_start = sim_now();
+        if (sim_scenario.upload_from) {
+            /* applied by the main thread before the first UPLOAD */
+            if (usb_vendor_request(false, DFUUSB_VENDOR_SET_UPLOAD_OFFSET,
+                                   sim_scenario.upload_from, 0, NULL, NULL)) {
+                sim_finish("SET_UPLOAD_OFFSET refused");
+            }
+            dfu.up_first = (uint32_t)sim_scenario.upload_from * dfu.size;
+            dfu.up_offset = dfu.up_first;
+        }
+        host_upload();
+        return;
+    }
+    sim_t_start = sim_now();
+    host_image_start();
+}
+
+uint64_t host_next_event(void)
+{
+    switch (dfu.state) {
+        case HOST_DNLOAD:
+        case HOST_STATUS:
+        case HOST_UPLOAD:
+        case HOST_UPLOAD_DATA:
+        case HOST_TARGET:
+            return dfu.next;
+        default:
+            return UINT64_MAX;
+    }
+}
+
+/* UPLOAD data stage done: the block must be the image data at its offset */
+static void host_upload_data(void)
+{
+    uint32_t left = (dfu.up_offset < sim_image.len) ? sim_image.len - dfu.up_offset : 0;
+    uint16_t expected = (left < dfu.size) ? left : dfu.size;
+
+    if (dfu.up_len != expected ||
+        memcmp(dfu.buf, sim_image.buf + sim_image.chunksize + dfu.up_offset, dfu.up_len)) {
+        sim_finish("UPLOAD block at offset %u: %u bytes read, %u expected, or wrong data",
+                   dfu.up_offset, dfu.up_len, expected);
+    }
+    sim_log("host: upload block at %u, %u bytes\n", dfu.up_offset, dfu.up_len);
+    dfu.up_offset += dfu.up_len;
+    dfu.up_blocks++;
+    /* a short frame ends the upload */
+    if (dfu.up_len < dfu.size || dfu.up_offset - dfu.up_first >= sim_scenario.upload) {
+        host_upload_end();
+        return;
+    }
+    host_upload();
+}
+
+bool host_handle_event(void)
+{
+    if (dfu.error != ERRNONE) {
+        host_error();
+        return false;
+    }
+    if (dfu.state == HOST_UPLOAD) {
+        /* setup stage done: libdfu asks the backend for the data */
+        dfu.reading = true;
+        dfu.state = HOST_UPLOAD_WAIT;
+        return true;
+    }
+    if (dfu.state == HOST_UPLOAD_DATA) {
+        host_upload_data();
+        return false;
+    }
+    if (dfu.state == HOST_TARGET) {
+        /* the vendor request event wakes the task */
+        host_image_start();
+        return true;
+    }
+    if (dfu.state == HOST_DNLOAD) {
+        /* data stage done: the block is in the libdfu buffer */
+        memcpy(dfu.buf, sim_image.buf + dfu.offset, dfu.len);
+        if (sim_scenario.bad_header && dfu.header_refusals == 0 && dfu.offset == 0) {
+            /* wrong firmware magic */
+            dfu.buf[0] ^= 0xff;
+        }
+        if (sim_scenario.refuse_block && dfu.recoveries == 0 &&
+            dfu.blocknum == sim_scenario.refuse_block) {
+            /* a block of the next crypto chunk, out of sequence */
+            dfu.sent_blocknum += sim_image.chunksize / dfu.xfer;
+        }
+        dfu.landed = true;
+        dfu.busy = true;
+        sim_log("host: block %u, %u bytes\n", dfu.sent_blocknum, dfu.len);
+        if (sim_scenario.reset_block && dfu.resets == 0 &&
+            dfu.blocknum == sim_scenario.reset_block) {
+            /* the block being stored is lost with the reset */
+            dfu.resets++;
+            dfu.state = HOST_DETACHED;
+            usb_bus_reset();
+            return true;
+        }
+        dfu.busy_since = sim_now();
+        dfu.state = HOST_STATUS;
+        dfu.next = sim_now() + sim_model.status_us;
+        return true;
+    }
+    /* GETSTATUS */
+    if (dfu.landed || dfu.busy) {
+        /* dfuDNBUSY, with the poll timeout */
+        dfu.polls++;
+        dfu.next = sim_now() + sim_model.poll_us + sim_model.status_us;
+        return false;
+    }
+    dfu.busy_time += sim_now() - dfu.busy_since;
+    if (dfu.eof) {
+        host_check_download();
+        /* dfuMANIFEST-SYNC: handled by the automaton */
+        sim_log("host: manifestation\n");
+        dfu.state = HOST_MANIFEST;
+        return true;
+    }
+    if (dfu.len) {
+        dfu.blocks++;
+    }
+    dfu.offset += dfu.len;
+    dfu.blocknum++;
+    host_dnload();
+    return false;
+}
+
+uint16_t host_xfer_size(void)
+{
+    return dfu.xfer;
+}
+
+uint32_t host_blocks(void)
+{
+    return sim_scenario.no_download ? dfu.up_blocks : dfu.blocks;
+}
+
+uint32_t host_bytes(void)
+{
+    return sim_scenario.no_download ? dfu.up_offset - dfu.up_first :
+                                      sim_image.size * sim_scenario.images;
+}
+
+void host_report(void)
+{
+    printf("host: %u blocks of %u bytes, %u dfuDNBUSY polls, %.3f ms waiting for the stores\n",
+           dfu.blocks, dfu.xfer, dfu.polls, dfu.busy_time / 1000.0);
+    if (dfu.recoveries || dfu.resets || dfu.header_refusals || dfu.negotiations) {
+        printf("host: %u recoveries, %u USB resets, %u resumes, %u header refusals, "
+               "%u negotiations\n", dfu.recoveries, dfu.resets, dfu.resumes,
+               dfu.header_refusals, dfu.negotiations);
+    }
+    if (dfu.up_blocks) {
+        printf("host: upload of %u bytes from %u in %u blocks, %.3f ms, %.3f MB/s\n",
+               dfu.up_offset - dfu.up_first, dfu.up_first, dfu.up_blocks, dfu.up_time / 1000.0,
+               dfu.up_time ? (double)(dfu.up_offset - dfu.up_first) / dfu.up_time : 0.0);
+    }
+}
+
+void dfu_declare(uint32_t usbxdci_handler)
+{
+    (void)usbxdci_handler;
+}
+
+void dfu_init(uint8_t *buffer, uint16_t max_size)
+{
+    dfu.buf = buffer;
+    dfu.size = max_size;
+    dfu.xfer = max_size;
+}
+
+/* USB reset: back to dfuIDLE, the block in the buffer being lost */
+void dfu_reinit(void)
+{
+    dfu.landed = false;
+    dfu.busy = false;
+    dfu.reading = false;
+}
+
+void dfu_exec_automaton(void)
+{
+    if (dfu.reading) {
+        dfu.reading = false;
+        dfu_backend_read(dfu.buf, dfu.size);
+    }
+    if (dfu.landed) {
+        dfu.landed = false;
+        if (dfu.len == 0) {
+            dfu_backend_eof();
+            dfu.busy = false;
+            dfu.eof = true;
+        } else {
+            sim_charge((uint64_t)dfu.len * sim_model.copy_us_kb / 1024);
+#if CONFIG_APP_DFUUSB_DIGEST
+            /* the image data only, not the header chunk */
+            if (dfu.offset >= sim_image.chunksize) {
+                sim_charge((uint64_t)dfu.len * sim_model.digest_us_kb / 1024);
+            }
+#endif
+            dfu_backend_write(dfu.buf, dfu.len, dfu.sent_blocknum);
+        }
+    }
+    if (dfu.state == HOST_MANIFEST) {
+        dfu.state = HOST_DONE;
+        dfu_reset_device();
+        if (dfu.image + 1 < sim_scenario.images) {
+            /* dfuIDLE again: the next image follows */
+            dfu.image++;
+            dfu.offset = 0;
+            dfu.blocknum = 0;
+            dfu.eof = false;
+            dfu.state = HOST_TARGET;
+            dfu.next = sim_now() + sim_model.usb_req_us;
+        }
+    }
+}
+
+void dfu_store_finished(void)
+{
+    if (!dfu.busy || dfu.landed) {
+        sim_finish("dfu_store_finished() without a block being stored");
+    }
+    dfu.busy = false;
+}
+
+void dfu_load_finished(uint16_t bytes_read)
+{
+    if (dfu.state != HOST_UPLOAD_WAIT || dfu.reading) {
+        sim_finish("dfu_load_finished() without a block being read");
+    }
+    dfu.up_len = bytes_read;
+    dfu.state = HOST_UPLOAD_DATA;
+    dfu.next = sim_now() + (uint64_t)bytes_read * sim_model.usb_us_kb / 1024;
+}
+
+void dfu_leave_session_with_error(dfu_status_enum_t status)
+{
+    sim_log("libdfu: session left with error %d\n", status);
+    dfu.error = status;
+    dfu.busy = false;
+}
@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Simulated libfirmware: header parsing only, the signature being checked
+ * by dfucrypto.
+ */
+#include <string.h>
+#include "libc/stdio.h"
+#include "libfw.h"
+
+int firmware_parse_header(uint8_t *buf, uint32_t len, uint32_t offset,
+                          firmware_header_t *header, uint8_t *sig)
+{
+    if (buf == NULL || header == NULL || offset + sizeof(firmware_header_t) > len) {
+        return -1;
+    }
+    memcpy(header, buf + offset, sizeof(firmware_header_t));
+    if (sig != NULL) {
+        if (offset + sizeof(firmware_header_t) + header->siglen > len) {
+            return -1;
+        }
+        memcpy(sig, buf + offset + sizeof(firmware_header_t), header->siglen);
+    }
+    return 0;
+}
+
+void firmware_print_header(firmware_header_t *header)
+{
+    printf("magic: %x, type: %x, version: %x, len: %d, siglen: %d, chunksize: %d\n",
+           header->magic, header->type, header->version, header->len,
+           header->siglen, header->chunksize);
+}
@@ -0,0 +1,154 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Simulated libusbctrl: the host configures the device enum_us after the
+ * device start, or after a bus reset, then sends its control requests to
+ * the declared vendor interface, if any.
+ */
+#include <string.h>
+#include "libusbctrl.h"
+#include "sim.h"
+
+/* interface number of the vendor interface, declared after the DFU one */
+#define SIM_VENDOR_IFACE 1
+
+static uint64_t config_at = UINT64_MAX;
+static usb_rqst_handler_t vendor_handler = NULL;
+static bool stalled = false;
+static uint8_t reply[256];
+static uint32_t reply_size = 0;
+
+mbed_error_t usbctrl_declare(uint32_t dev_id, uint32_t *ctxh)
+{
+    (void)dev_id;
+    *ctxh = 0;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usbctrl_initialize(uint32_t ctxh)
+{
+    (void)ctxh;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usbctrl_start_device(uint32_t ctxh)
+{
+    (void)ctxh;
+    config_at = sim_now() + sim_model.enum_us;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usbctrl_declare_interface(uint32_t ctxh, usbctrl_interface_t *iface)
+{
+    (void)ctxh;
+    if (iface->usb_class == USB_CLASS_VENDOR_SPEC) {
+        vendor_handler = iface->rqst_handler;
+    }
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_send_data(uint8_t *src, uint32_t size, uint8_t ep)
+{
+    (void)ep;
+    if (size > sizeof(reply)) {
+        sim_finish("control reply of %u bytes", size);
+    }
+    memcpy(reply, src, size);
+    reply_size = size;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_send_zlp(uint8_t ep)
+{
+    (void)ep;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_ack(uint8_t ep, usb_backend_drv_ep_dir_t dir)
+{
+    (void)ep;
+    (void)dir;
+    return MBED_ERROR_NONE;
+}
+
+mbed_error_t usb_backend_drv_stall(uint8_t ep, usb_backend_drv_ep_dir_t dir)
+{
+    (void)ep;
+    (void)dir;
+    stalled = true;
+    return MBED_ERROR_NONE;
+}
+
+int usb_vendor_request(bool in, uint8_t bRequest, uint16_t wValue, uint16_t wLength,
+                       void *data, uint32_t *size)
+{
+    usbctrl_setup_pkt_t pkt = {
+        .bmRequestType = (in ? 0x80 : 0x00) | 0x40 | 0x01,
+        .bRequest = bRequest,
+        .wValue = wValue,
+        .wIndex = SIM_VENDOR_IFACE,
+        .wLength = wLength,
+    };
+
+    if (vendor_handler == NULL) {
+        sim_finish("vendor request %u without a vendor interface", bRequest);
+    }
+    stalled = false;
+    reply_size = 0;
+    /* in ISR context */
+    if (vendor_handler(0, &pkt) != MBED_ERROR_NONE || stalled) {
+        sim_log("host: vendor request %u refused\n", bRequest);
+        return -1;
+    }
+    if (data != NULL) {
+        memcpy(data, reply, reply_size);
+    }
+    if (size != NULL) {
+        *size = reply_size;
+    }
+    return 0;
+}
+
+void usb_bus_reset(void)
+{
+    sim_log("host: USB reset\n");
+    /* in ISR context */
+    usbctrl_reset_received();
+    config_at = sim_now() + sim_model.enum_us;
+}
+
+uint64_t usb_next_event(void)
+{
+    return config_at;
+}
+
+/* SetConfiguration interrupt */
+bool usb_handle_event(void)
+{
+    config_at = UINT64_MAX;
+    usbctrl_configuration_set();
+    host_start();
+    return true;
+}
@@ -0,0 +1,490 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host simulator main: image generation, virtual clock, event dispatch and
+ * final report. See sim.h.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "automaton.h"
+#include "libfw.h"
+#include "sim.h"
+
+/* the report goes to stdout, whatever the task console */
+#undef printf
+
+int _main(uint32_t task_id);
+
+t_sim_image sim_image = { 0 };
+t_sim_scenario sim_scenario = { 0 };
+bool sim_verbose = false;
+uint64_t sim_t_start = 0;
+uint64_t sim_t_commit = 0;
+
+/*
+ * Default latency model: USB 2.0 high speed control transfers, STM32F4
+ * flash (x32 parallelism, typical datasheet timings) with a target range
+ * starting on a bank boundary, and a dfucrypto handling one request at a
+ * time.
+ */
+t_sim_model sim_model = {
+    .enum_us       = 50000,
+    .usb_req_us    = 125,
+    .usb_us_kb     = 100,
+    .status_us     = 125,
+    .poll_us       = 1000,
+    .syscall_us    = 2,
+    .copy_us_kb    = 6,
+    /* CRC32 slicing-by-8, about 3 cycles per byte at 168 MHz */
+    .digest_us_kb  = 18,
+    .boot_us       = 20000,
+    .ipc_us        = 30,
+    .auth_us       = 100000,
+    .decrypt_us_kb = 60,
+    .read_us_kb    = 4,
+    .prog_us_word  = 16,
+    .erase16_us    = 250000,
+    .erase64_us    = 550000,
+    .erase128_us   = 1000000,
+    .flash_offset  = 0,
+    .peer_queue    = 1,
+    .peer_version  = 1,
+};
+
+static uint64_t now = 0;
+/* task CPU time, charged by the simulated components */
+static uint64_t cpu_time = 0;
+/* virtual time limit, a stalled download ending there */
+static uint64_t max_time = 600ULL * 1000000;
+
+uint64_t sim_now(void)
+{
+    return now;
+}
+
+typedef struct {
+    uint64_t (*next_event)(void);
+    bool     (*handle_event)(void);
+} t_sim_component;
+
+/* in priority order, for events due at the same time */
+static const t_sim_component components[] = {
+    { usb_next_event,  usb_handle_event },
+    { host_next_event, host_handle_event },
+    { peer_next_event, peer_handle_event },
+};
+
+#define SIM_COMPONENTS (sizeof(components) / sizeof(components[0]))
+
+/*
+ * Handle the earliest event if it is due by the deadline.
+ * Return -1 if there is none, 1 if it wakes the task, 0 otherwise.
+ */
+static int sim_step(uint64_t deadline)
+{
+    const t_sim_component *first = NULL;
+    uint64_t first_ts = UINT64_MAX;
+    uint64_t ts;
+    uint8_t i;
+
+    for (i = 0; i < SIM_COMPONENTS; ++i) {
+        ts = components[i].next_event();
+        if (ts < first_ts) {
+            first_ts = ts;
+            first = &components[i];
+        }
+    }
+    if (first == NULL || first_ts > deadline) {
+        return -1;
+    }
+    if (first_ts > now) {
+        now = first_ts;
+    }
+    if (now > max_time) {
+        sim_finish("virtual time limit reached");
+    }
+    return first->handle_event() ? 1 : 0;
+}
+
+void sim_charge(uint32_t us)
+{
+    uint64_t end = now + us;
+
+    cpu_time += us;
+    while (sim_step(end) >= 0) {
+        continue;
+    }
+    now = end;
+}
+
+bool sim_wait_until(uint64_t deadline)
+{
+    int ret;
+
+    while ((ret = sim_step(deadline)) == 0) {
+        continue;
+    }
+    if (ret > 0) {
+        return true;
+    }
+    if (deadline > now) {
+        now = deadline;
+    }
+    if (now > max_time) {
+        sim_finish("virtual time limit reached");
+    }
+    return false;
+}
+
+bool sim_wait_event(void)
+{
+    return sim_step(UINT64_MAX) >= 0;
+}
+
+void sim_log(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!sim_verbose) {
+        return;
+    }
+    printf("[%10llu] ", (unsigned long long)now);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+/* task console */
+int sim_printf(const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    if (!sim_verbose) {
+        return 0;
+    }
+    va_start(ap, fmt);
+    ret = vprintf(fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+void aprintf_flush(void)
+{
+    fflush(stdout);
+}
+
+static void sim_report_states(void)
+{
+    t_dfuusb_state_stats stats;
+    uint8_t state;
+
+    for (state = DFUUSB_STATE_INIT; state < DFUUSB_STATE_NUM; ++state) {
+        get_state_stats(state, &stats);
+        if (stats.entries == 0 && stats.time == 0) {
+            continue;
+        }
+        printf("state %-22s %5u entries %10.3f ms\n", get_state_name(state),
+               stats.entries, stats.time / 1000.0);
+    }
+}
+
+void sim_finish(const char *why, ...)
+{
+    uint64_t duration = sim_t_commit - sim_t_start;
+    va_list ap;
+
+    printf("image: %u bytes (chunk %u, data %u)\n",
+           sim_image.size, sim_image.chunksize, sim_image.len);
+    host_report();
+    peer_report();
+    kernel_report();
+    printf("cpu: %.3f ms busy, %.2f%% idle\n", cpu_time / 1000.0,
+           now ? 100.0 - cpu_time * 100.0 / now : 100.0);
+    sim_report_states();
+    if (why != NULL) {
+        printf("result: FAIL at %.3f ms: ", now / 1000.0);
+        va_start(ap, why);
+        vprintf(why, ap);
+        va_end(ap);
+        printf("\n");
+        exit(1);
+    }
+    if (sim_t_commit == 0 || duration == 0) {
+        printf("result: FAIL: reboot without committed image\n");
+        exit(1);
+    }
+    printf("result: OK %.3f ms %.1f blocks/s %.3f MB/s\n", duration / 1000.0,
+           host_blocks() * 1000000.0 / duration,
+           (double)host_bytes() / duration);
+    exit(0);
+}
+
+/* xorshift32, for reproducible image contents */
+static uint32_t sim_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int sim_make_image(uint32_t len, uint32_t chunksize, uint32_t seed)
+{
+    firmware_header_t hdr;
+    uint32_t i;
+
+    if (chunksize < CONFIG_APP_DFUUSB_HEADER_LEN || len == 0) {
+        return -1;
+    }
+    sim_image.chunksize = chunksize;
+    sim_image.len = len;
+    sim_image.size = chunksize + len;
+    sim_image.buf = calloc(1, sim_image.size);
+    if (sim_image.buf == NULL) {
+        return -1;
+    }
+    for (i = 0; i < sim_image.size; ++i) {
+        sim_image.buf[i] = (uint8_t)sim_rand(&seed);
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = 0x57464b44;
+    hdr.type = 0;
+    hdr.version = 1;
+    hdr.len = len;
+    hdr.siglen = 64;
+    hdr.chunksize = chunksize;
+    memcpy(sim_image.buf, &hdr, sizeof(hdr));
+    /* signature in the header, then padding up to the end of the chunk */
+    memset(sim_image.buf + sizeof(hdr) + hdr.siglen, 0,
+           chunksize - sizeof(hdr) - hdr.siglen);
+    return 0;
+}
+
+static int sim_save_image(const char *path)
+{
+    FILE *f;
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        goto err;
+    }
+    if (fwrite(sim_image.buf, 1, sim_image.size, f) != sim_image.size) {
+        fclose(f);
+        goto err;
+    }
+    if (fclose(f)) {
+        goto err;
+    }
+    return 0;
+err:
+    fprintf(stderr, "%s: can't write the image\n", path);
+    return -1;
+}
+
+/* image file: header crypto chunk, then data */
+static int sim_load_image(const char *path)
+{
+    firmware_header_t hdr;
+    FILE *f;
+    long size;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        goto err;
+    }
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET)) {
+        goto err_close;
+    }
+    sim_image.buf = malloc(size);
+    if (sim_image.buf == NULL ||
+        fread(sim_image.buf, 1, size, f) != (size_t)size) {
+        goto err_close;
+    }
+    fclose(f);
+    if (firmware_parse_header(sim_image.buf, size, 0, &hdr, NULL) ||
+        (uint64_t)hdr.chunksize + hdr.len != (uint64_t)size) {
+        fprintf(stderr, "%s: header chunk size and data length do not match the file\n", path);
+        return -1;
+    }
+    sim_image.size = size;
+    sim_image.chunksize = hdr.chunksize;
+    sim_image.len = hdr.len;
+    return 0;
+err_close:
+    fclose(f);
+err:
+    fprintf(stderr, "%s: can't read the image\n", path);
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+           "  --size BYTES          data size of the generated image (default 262144)\n"
+           "  --chunk BYTES         crypto chunk size (default the DMA SHM slot size)\n"
+           "  --seed N              generated image contents\n"
+           "  --image FILE          replay an image file (header chunk, then data)\n"
+           "  --save-image FILE     write the generated image to a file, and exit\n"
+           "  --usb-us-kb US        USB data stage time per KiB\n"
+           "  --usb-req-us US       USB control request overhead\n"
+           "  --poll-ms MS          host wait after a dfuDNBUSY status\n"
+           "  --auth-ms MS          header authentication by dfucrypto\n"
+           "  --decrypt-us-kb US    decryption time per KiB\n"
+           "  --digest-us-kb US     streaming digest time per KiB\n"
+           "  --read-us-kb US       flash readback time per KiB\n"
+           "  --prog-us-word US     flash programming time per word\n"
+           "  --erase-ms A,B,C      16K, 64K and 128K sector erase times\n"
+           "  --flash-offset BYTES  image offset in the flash bank\n"
+           "  --peer-queue N        requests dfucrypto accepts before acknowledging\n"
+           "  --peer-version N      IPC framing version of dfucrypto\n"
+           "  --upload BYTES        read back image data before the download\n"
+           "  --upload-from BLOCK   first block read back (SET_UPLOAD_OFFSET)\n"
+           "  --no-download         end after the readback, measuring it\n"
+           "  --images N            download the image to N targets (SET_TARGET)\n"
+           "  --refuse BLOCK        send this block out of sequence, then recover\n"
+           "  --reset-at BLOCK      USB reset after this block, then resume\n"
+           "  --bad-header STATUS   send a corrupted header first, refused with STATUS\n"
+           "  --negotiate           restart with the negotiated transfer size\n"
+           "  --stray-ipc           unknown and stale dfucrypto IPCs during the download\n"
+           "  --digest              check GET_DIGEST before the manifestation\n"
+           "  --vendor              check the other vendor requests before the manifestation\n"
+           "  --max-s S             virtual time limit\n"
+           "  -v                    task console and simulator log\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "size",          required_argument, NULL, 's' },
+        { "chunk",         required_argument, NULL, 'c' },
+        { "seed",          required_argument, NULL, 'S' },
+        { "image",         required_argument, NULL, 'i' },
+        { "usb-us-kb",     required_argument, NULL, 'u' },
+        { "usb-req-us",    required_argument, NULL, 'r' },
+        { "poll-ms",       required_argument, NULL, 'p' },
+        { "auth-ms",       required_argument, NULL, 'a' },
+        { "decrypt-us-kb", required_argument, NULL, 'd' },
+        { "digest-us-kb",  required_argument, NULL, 'g' },
+        { "read-us-kb",    required_argument, NULL, 'R' },
+        { "prog-us-word",  required_argument, NULL, 'w' },
+        { "erase-ms",      required_argument, NULL, 'e' },
+        { "flash-offset",  required_argument, NULL, 'o' },
+        { "peer-queue",    required_argument, NULL, 'q' },
+        { "peer-version",  required_argument, NULL, 'V' },
+        { "upload",        required_argument, NULL, 'U' },
+        { "upload-from",   required_argument, NULL, 'F' },
+        { "no-download",   no_argument,       NULL, 'N' },
+        { "images",        required_argument, NULL, 'I' },
+        { "save-image",    required_argument, NULL, 'W' },
+        { "refuse",        required_argument, NULL, 'X' },
+        { "reset-at",      required_argument, NULL, 'Z' },
+        { "bad-header",    required_argument, NULL, 'B' },
+        { "negotiate",     no_argument,       NULL, 'n' },
+        { "stray-ipc",     no_argument,       NULL, 'y' },
+        { "digest",        no_argument,       NULL, 'D' },
+        { "vendor",        no_argument,       NULL, 'T' },
+        { "max-s",         required_argument, NULL, 'm' },
+        { "help",          no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    uint32_t len = 262144;
+    uint32_t chunksize = CONFIG_APP_DFUUSB_SHM_SLOT_SIZE;
+    uint32_t seed = 0x2545f491;
+    const char *image = NULL;
+    const char *save = NULL;
+    unsigned e16, e64, e128;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "vh", options, NULL)) != -1) {
+        switch (opt) {
+            case 's': len = strtoul(optarg, NULL, 0); break;
+            case 'c': chunksize = strtoul(optarg, NULL, 0); break;
+            case 'S': seed = strtoul(optarg, NULL, 0) | 1; break;
+            case 'i': image = optarg; break;
+            case 'u': sim_model.usb_us_kb = strtoul(optarg, NULL, 0); break;
+            case 'r': sim_model.usb_req_us = strtoul(optarg, NULL, 0); break;
+            case 'p': sim_model.poll_us = strtoul(optarg, NULL, 0) * 1000; break;
+            case 'a': sim_model.auth_us = strtoul(optarg, NULL, 0) * 1000; break;
+            case 'd': sim_model.decrypt_us_kb = strtoul(optarg, NULL, 0); break;
+            case 'g': sim_model.digest_us_kb = strtoul(optarg, NULL, 0); break;
+            case 'R': sim_model.read_us_kb = strtoul(optarg, NULL, 0); break;
+            case 'w': sim_model.prog_us_word = strtoul(optarg, NULL, 0); break;
+            case 'e':
+                if (sscanf(optarg, "%u,%u,%u", &e16, &e64, &e128) != 3) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                sim_model.erase16_us = e16 * 1000;
+                sim_model.erase64_us = e64 * 1000;
+                sim_model.erase128_us = e128 * 1000;
+                break;
+            case 'o': sim_model.flash_offset = strtoul(optarg, NULL, 0); break;
+            case 'q': sim_model.peer_queue = strtoul(optarg, NULL, 0); break;
+            case 'V': sim_model.peer_version = strtoul(optarg, NULL, 0); break;
+            case 'U': sim_scenario.upload = strtoul(optarg, NULL, 0); break;
+            case 'F': sim_scenario.upload_from = strtoul(optarg, NULL, 0); break;
+            case 'N': sim_scenario.no_download = true; break;
+            case 'I': sim_scenario.images = strtoul(optarg, NULL, 0); break;
+            case 'W': save = optarg; break;
+            case 'X': sim_scenario.refuse_block = strtoul(optarg, NULL, 0); break;
+            case 'Z': sim_scenario.reset_block = strtoul(optarg, NULL, 0); break;
+            case 'B': sim_scenario.bad_header = strtoul(optarg, NULL, 0); break;
+            case 'n': sim_scenario.negotiate = true; break;
+            case 'y': sim_scenario.stray_ipc = true; break;
+            case 'D': sim_scenario.digest = true; break;
+            case 'T': sim_scenario.vendor = true; break;
+            case 'm': max_time = strtoull(optarg, NULL, 0) * 1000000; break;
+            case 'v': sim_verbose = true; break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+    if (image != NULL ? sim_load_image(image) : sim_make_image(len, chunksize, seed)) {
+        fprintf(stderr, "invalid image\n");
+        return 2;
+    }
+    if (save != NULL) {
+        return sim_save_image(save) ? 2 : 0;
+    }
+    if (sim_scenario.images == 0) {
+        sim_scenario.images = 1;
+    }
+    if (sim_scenario.no_download && sim_scenario.upload == 0) {
+        fprintf(stderr, "nothing to do without download nor upload\n");
+        return 2;
+    }
+    peer_init();
+    /* returns only if the initialization fails */
+    _main(SIM_ID_DFUUSB);
+    sim_finish("_main() returned");
+}
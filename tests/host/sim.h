@@ -0,0 +1,161 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host simulator of the dfuusb task: the task sources run unchanged
+ * against a simulated kernel, libdfu (with the USB host driving it) and
+ * dfucrypto peer, all on a single virtual clock in microseconds. The task
+ * code itself takes no virtual time, except for the costs charged by the
+ * simulator (syscalls, block copies).
+ */
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* task ids, as returned by sys_init(INIT_GETTASKID) */
+#define SIM_ID_DFUUSB       1
+#define SIM_ID_DFUCRYPTO    2
+
+/* simulated image, as sent by the host */
+typedef struct {
+    uint8_t  *buf;          /* header crypto chunk, then data */
+    uint32_t  size;         /* whole image size */
+    uint32_t  chunksize;    /* crypto chunk size, the header chunk included */
+    uint32_t  len;          /* data size, after the header chunk */
+} t_sim_image;
+
+/* latency model, all durations in us */
+typedef struct {
+    /* USB host */
+    uint32_t enum_us;           /* reset to SetConfiguration */
+    uint32_t usb_req_us;        /* control request overhead */
+    uint32_t usb_us_kb;         /* data stage, per KiB */
+    uint32_t status_us;         /* GETSTATUS request */
+    uint32_t poll_us;           /* wait after a dfuDNBUSY status */
+    /* dfuusb */
+    uint32_t syscall_us;
+    uint32_t copy_us_kb;        /* block copy, per KiB */
+    uint32_t digest_us_kb;      /* streaming digest, per KiB (CONFIG_APP_DFUUSB_DIGEST) */
+    /* dfucrypto */
+    uint32_t boot_us;           /* end_of_init to ready */
+    uint32_t ipc_us;            /* request handling */
+    uint32_t auth_us;           /* header signature check */
+    uint32_t decrypt_us_kb;     /* per KiB */
+    uint32_t read_us_kb;        /* flash readback, per KiB */
+    uint32_t prog_us_word;      /* flash programming, per 32-bit word */
+    uint32_t erase16_us;        /* sector erase, per sector size */
+    uint32_t erase64_us;
+    uint32_t erase128_us;
+    uint32_t flash_offset;      /* image offset in the flash bank */
+    uint32_t peer_queue;        /* requests accepted before acknowledging */
+    uint8_t  peer_version;      /* IPC framing version of dfucrypto */
+} t_sim_model;
+
+/* host scenario */
+typedef struct {
+    uint32_t upload;            /* bytes read back before the download */
+    uint16_t upload_from;       /* first block read back, set by vendor request */
+    bool     no_download;       /* end after the readback */
+    uint8_t  images;            /* images downloaded, each one after a SET_TARGET if several */
+    /* failure paths, each one expected to happen once */
+    uint16_t refuse_block;      /* block sent out of sequence, then recovered (GET_RECOVERY) */
+    uint16_t reset_block;       /* USB reset after this block, then resumed (GET_RESUME) */
+    uint8_t  bad_header;        /* header sent corrupted first, refused with this DFU status */
+    bool     negotiate;         /* download restarted with the negotiated transfer size */
+    bool     stray_ipc;         /* dfucrypto sends unknown and stale IPCs during the download */
+    /* vendor requests checked before the manifestation */
+    bool     digest;            /* GET_DIGEST, against the image data */
+    bool     vendor;            /* GET_XFER_SIZE, GET_STATES, GET_STATS */
+} t_sim_scenario;
+
+extern t_sim_image sim_image;
+extern t_sim_model sim_model;
+extern t_sim_scenario sim_scenario;
+extern bool sim_verbose;
+/* first DNLOAD request, and commit of the image by dfucrypto (first and
+ * last UPLOAD requests when there is no download) */
+extern uint64_t sim_t_start;
+extern uint64_t sim_t_commit;
+
+/* virtual clock */
+uint64_t sim_now(void);
+
+/* task CPU time: the clock advances, the due events being handled */
+void sim_charge(uint32_t us);
+
+/*
+ * Wait up to the deadline, or up to an event waking the task (USB
+ * interrupt or IPC to the task). Return true if woken.
+ */
+bool sim_wait_until(uint64_t deadline);
+
+/* wait for the next event, whatever it is. Return false if there is none */
+bool sim_wait_event(void);
+
+void sim_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* end of the simulation: report and exit, failed if why is not NULL */
+void sim_finish(const char *why, ...) __attribute__((noreturn));
+
+/*
+ * Simulated components: each one gives the time of its next event
+ * (UINT64_MAX if none), and handles it, returning true if it wakes the task.
+ */
+uint64_t usb_next_event(void);
+bool usb_handle_event(void);
+/* USB bus reset, the host enumerating the device again */
+void usb_bus_reset(void);
+/* control request to the vendor interface: return -1 if refused (stall) */
+int usb_vendor_request(bool in, uint8_t bRequest, uint16_t wValue, uint16_t wLength,
+                       void *data, uint32_t *size);
+
+uint64_t host_next_event(void);
+bool host_handle_event(void);
+void host_start(void);
+void host_report(void);
+uint16_t host_xfer_size(void);
+uint32_t host_blocks(void);
+uint32_t host_bytes(void);
+
+uint64_t peer_next_event(void);
+bool peer_handle_event(void);
+void peer_init(void);
+void peer_report(void);
+/* image data from this offset sent again by the host, and stored again */
+void peer_rewind(uint32_t offset);
+
+void kernel_report(void);
+
+/* IPC from the task: return false if dfucrypto can't receive it yet */
+bool peer_recv(const uint8_t *msg, uint32_t size);
+
+/* dfucrypto is blocked sending to the task */
+bool peer_sending(void);
+
+/* IPC to the task: return false if none is pending */
+bool peer_send(uint8_t *msg, uint32_t *size);
+
+#endif/*!HOST_SIM_H_*/
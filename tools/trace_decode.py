@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+#
+# Decode the dfuusb binary trace records ("T <ev> <ts> <a> <b>", hex) from
+# a console log. Event and state names are read from the sources, so that
+# the decoder follows src/trace.h and src/automaton.h.
+#
+# usage: trace_decode.py [console.log]   (stdin by default)
+
+import os
+import re
+import sys
+
+SRC = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'src')
+
+
+def parse_enum(path, prefix):
+    names = []
+    with open(path) as f:
+        for line in f:
+            m = re.match(r'\s*(' + prefix + r'\w+)\s*(=\s*0)?\s*,', line)
+            if m:
+                names.append(m.group(1))
+    return names
+
+
+def main():
+    events = parse_enum(os.path.join(SRC, 'trace.h'), 'TRACE_EV_')
+    states = parse_enum(os.path.join(SRC, 'automaton.h'), 'DFUUSB_STATE_')
+    state_evs = (events.index('TRACE_EV_STATE'), events.index('TRACE_EV_ILLEGAL_STATE'))
+    log = open(sys.argv[1]) if len(sys.argv) > 1 else sys.stdin
+    prev_ts = None
+
+    for line in log:
+        m = re.match(r'\s*T ([0-9a-fA-F]+) ([0-9a-fA-F]+) ([0-9a-fA-F]+) ([0-9a-fA-F]+)\s*$', line)
+        if not m:
+            continue
+        ev, ts, a, b = (int(x, 16) for x in m.groups())
+        name = events[ev] if ev < len(events) else 'EV_%d' % ev
+        if ev == 0:
+            # dropped events record, not timestamped
+            print('%10s %-9s %-26s %d events lost' % ('-', '', name[len('TRACE_EV_'):], a))
+            continue
+        delta = 0 if prev_ts is None else (ts - prev_ts) & 0xffffffff
+        prev_ts = ts
+        if ev in state_evs and a < len(states) and b < len(states):
+            args = '%s => %s' % (states[a], states[b])
+        else:
+            args = 'a=%d (0x%x) b=%d (0x%x)' % (a, a, b, b)
+        print('%10d +%-8d %-26s %s' % (ts, delta, name[len('TRACE_EV_'):], args))
+
+
+if __name__ == '__main__':
+    main()